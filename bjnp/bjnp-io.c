@@ -21,7 +21,10 @@
 #include <arpa/inet.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #ifdef HAVE_SYS_TYPES_H
 #  include <sys/types.h>
@@ -44,10 +47,23 @@
 #include <netdb.h>
 #include <cups/http.h>
 #include <net/if.h>
+#include <sys/uio.h>
+#include <fnmatch.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define HAVE_X86_SIMD 1
+#endif
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#  include <linux/errqueue.h>
+#  define HAVE_MSG_ZEROCOPY 1
+#endif
 
 #ifdef HAVE_GETIFADDRS
 #include <ifaddrs.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif
 
 /* local definitions */
 
@@ -63,14 +79,92 @@ static uint16_t serial = 0;
 static uint16_t session_id;
 static char cur_printer_model[BJNP_MODEL_MAX];
 static char cur_printer_IEEE1284_id[BJNP_IEEE1284_MAX];
+
+/*
+ * ring of io slots, one for each print packet that is waiting for an ack
+ * slots are allocated and retired in the order the packets were sent
+ * The print data itself is not copied, it stays in the callers buffer
+ * until the slot is retired
+ */
+
 static struct
 {
+  struct BJNP_command cmd;	/* command header, kept until retired */
   uint16_t seq_no;
-  ssize_t count;
-  char print_buf[BJNP_PRINTBUF_MAX + sizeof (struct BJNP_command)];
-  char free;
+  ssize_t count;		/* nr of print bytes in packet */
+  ssize_t acked;		/* nr of print bytes acked by printer */
+  uint32_t zc_id;		/* MSG_ZEROCOPY send number */
+  char zerocopy;		/* sent with MSG_ZEROCOPY? */
+  char state;			/* SLOT_FREE, SLOT_SENT or SLOT_ACKED */
 }
-io_slot;
+io_slot[BJNP_WINDOW_MAX];
+
+#define SLOT_FREE  0
+#define SLOT_SENT  1
+#define SLOT_ACKED 2
+
+static int slot_head = 0;	/* oldest outstanding slot */
+static int slots_used = 0;	/* nr of outstanding slots */
+static int window_size = 1;	/* max. nr of outstanding slots */
+static int cur_window = 1;	/* current nr of outstanding slots allowed */
+static int rejecting = 0;	/* printer rejected a packet, wait for */
+				/* all outstanding acks before sending */
+static int rejected_retired = 0;	/* a rejected packet was retired */
+static int zerocopy = 0;	/* use MSG_ZEROCOPY for large packets */
+static uint32_t zc_sent = 0;	/* nr of MSG_ZEROCOPY sends */
+static uint32_t zc_done = 0;	/* nr of completed MSG_ZEROCOPY sends */
+static int chunk_size = BJNP_PRINTBUF_MAX;	/* print packet size in use */
+static int chunk_auto = 0;	/* probe for larger packet sizes? */
+static int chunk_probing = 0;	/* still probing in this job? */
+static int chunk_good = BJNP_PRINTBUF_MAX;	/* largest size fully acked */
+static int chunk_probe_ok = 0;	/* nr of full packets acked at chunk_size */
+static long throttle_delay = 0;	/* current throttle backoff (usec) */
+static struct timeval throttle_until;	/* no print data before this time */
+static struct timeval throttle_start;	/* start of current throttle period */
+static int throttle_active = 0;	/* throttle period in progress? */
+static int throttle_count = 0;	/* nr of times printer throttled this job */
+static long throttle_msec = 0;	/* time spent throttling this job */
+static unsigned int printer_bst = 0;	/* last BST flags read from printer */
+static int printer_bst_valid = 0;	/* printer_bst was read? */
+static int ctl_fd = -1;		/* UDP control socket of print session */
+static http_addr_t ctl_addr;	/* address ctl_fd is connected to */
+static long ctl_srtt = 0;	/* smoothed round trip time (usec), 0 if */
+				/* not measured yet */
+static long ctl_rttvar = 0;	/* round trip time variation (usec) */
+static struct
+{
+  int in_use;			/* entry in use? */
+  uint16_t seq;			/* seq_no of request */
+  char *resp;			/* response buffer */
+  int resp_max;			/* size of response buffer */
+  int resp_len;			/* length of response, -1 = none yet */
+} ctl_req[BJNP_CTL_MAX];	/* requests waiting for a response */
+static struct BJNP_command status_cmd;	/* outstanding status query */
+static int status_req = -1;	/* its entry in ctl_req */
+static int status_tries = 0;	/* nr of times it was sent, 0 = none */
+static struct timeval status_sent;	/* time it was last sent */
+static struct IDENTITY status_resp;	/* response to status query */
+static char ack_buf[BJNP_RESP_MAX];	/* received, unprocessed responses */
+static size_t ack_len = 0;	/* nr of bytes in ack_buf */
+static unsigned long io_syscalls = 0;	/* nr of system calls this job */
+static unsigned long io_acked = 0;	/* nr of bytes acked this job */
+static long ack_timeout = BJNP_ACK_TIMEOUT_USEC;	/* max. wait for an */
+					/* ack, 0 = forever */
+static struct timeval ack_progress;	/* last ack or first packet sent */
+static int window_reset = 0;	/* packets waiting for an ack were dropped */
+static char job_user[256];	/* user of current job, used to resume it */
+static char job_title[256];	/* title of current job */
+static http_addr_t job_addr;	/* printer address of current job */
+static int job_addr_valid = 0;	/* job_addr is set? */
+static char job_mac[6];		/* mac address of printer of current job */
+static int job_mac_valid = 0;	/* job_mac is set? */
+static int id_refresh = 0;	/* identity must be looked up again? */
+static int discover_rounds = BJNP_DISCOVER_ROUNDS;	/* nr of discover */
+					/* broadcasts sent */
+static const char *discover_include = NULL;	/* interfaces to discover */
+					/* printers on, NULL = all */
+static const char *discover_exclude = NULL;	/* interfaces not to */
+					/* discover printers on */
 
 int
 parse_IEEE1284_to_model (char *printer_id, char *model)
@@ -140,6 +234,11 @@ parse_status_to_paperout (char *status_str)
 			  status, ((status & BST_PRINTING) != 0),
 			  ((status & BST_BUSY) != 0),
 			  ((status & BST_OPCALL) != 0));
+
+	      /* keep status, it is used to tune the throttle delay */
+
+	      printer_bst = status;
+	      printer_bst_valid = 1;
 	      if (status & BST_OPCALL)
 		{
 		  bjnp_debug (LOG_INFO, "Paper out!\n");
@@ -189,30 +288,229 @@ charTo2byte (char d[], char s[], int len)
 }
 
 
-int
-find_bin_string (const void *in, int len, char *lookfor, int size)
+/*
+ * Streaming splitter for the BJL start command. Each start command must be
+ * sent at the start of a new print packet. The print stream is searched
+ * once, a command that straddles two blocks of data is found by carrying 
+ * the nr of bytes matched at the end of a block to the next block
+ */
+
+static const char bjl_start_cmd[] = { 0x1b, 0x5b, 0x4b, 0x2, 0x0, 0x0 };
+
+#define BJL_START_CMD_LEN ((int) sizeof (bjl_start_cmd))
+
+static const char *
+find_cmd_candidate_scalar (const char *p, const char *end)
 {
-  /* 
-   * looks for a new print command in the input stream 
-   * Returns: offset where lookfor is found or -1 when not found
+  /*
+   * Returns: first position in [p, end) that holds the first 2 bytes of the 
+   * start command, or the first byte at the end of the block, else end
    */
 
-  int i;
-  const char *buf = in;
+  while ((p < end)
+	 && ((p = memchr (p, bjl_start_cmd[0], end - p)) != NULL))
+    {
+      if ((p + 1 == end) || (p[1] == bjl_start_cmd[1]))
+	return p;
+      p++;
+    }
+  return end;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__ ((target ("sse2")))
+static const char *
+find_cmd_candidate_sse2 (const char *p, const char *end)
+{
+  const __m128i c0 = _mm_set1_epi8 (bjl_start_cmd[0]);
+  const __m128i c1 = _mm_set1_epi8 (bjl_start_cmd[1]);
+  unsigned int mask;
+
+  /* compare 16 positions at a time on both the first and second byte */
+
+  while (end - p > 16)
+    {
+      mask =
+	_mm_movemask_epi8 (_mm_and_si128
+			   (_mm_cmpeq_epi8
+			    (_mm_loadu_si128 ((const __m128i *) p), c0),
+			    _mm_cmpeq_epi8 (_mm_loadu_si128
+					    ((const __m128i *) (p + 1)), c1)));
+      if (mask)
+	return p + __builtin_ctz (mask);
+      p += 16;
+    }
+  return find_cmd_candidate_scalar (p, end);
+}
+
+__attribute__ ((target ("avx2")))
+static const char *
+find_cmd_candidate_avx2 (const char *p, const char *end)
+{
+  const __m256i c0 = _mm256_set1_epi8 (bjl_start_cmd[0]);
+  const __m256i c1 = _mm256_set1_epi8 (bjl_start_cmd[1]);
+  unsigned int mask;
 
-  /* start at offset 1 to avoid match at start of input */
-  for (i = 1; i < (len - size); i++)
+  /* compare 32 positions at a time on both the first and second byte */
+
+  while (end - p > 32)
+    {
+      mask =
+	_mm256_movemask_epi8 (_mm256_and_si256
+			      (_mm256_cmpeq_epi8
+			       (_mm256_loadu_si256 ((const __m256i *) p), c0),
+			       _mm256_cmpeq_epi8 (_mm256_loadu_si256
+						  ((const __m256i *) (p + 1)),
+						  c1)));
+      if (mask)
+	return p + __builtin_ctz (mask);
+      p += 32;
+    }
+  return find_cmd_candidate_scalar (p, end);
+}
+#endif /* HAVE_X86_SIMD */
+
+static const char *(*find_cmd_candidate) (const char *, const char *) = NULL;
+
+static void
+select_cmd_search (void)
+{
+  /*
+   * select the fastest search function this cpu supports
+   */
+
+  find_cmd_candidate = find_cmd_candidate_scalar;
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    find_cmd_candidate = find_cmd_candidate_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    find_cmd_candidate = find_cmd_candidate_sse2;
+#endif
+  bjnp_debug (LOG_DEBUG, "Using %s search for BJL commands\n",
+	      (find_cmd_candidate == find_cmd_candidate_scalar) ? "scalar" :
+	      "vectorized");
+}
+
+static ssize_t
+split_scan (bjnp_splitter_t * sp, const char *buf, size_t len)
+{
+  /*
+   * search buf, that holds len bytes of the stream from sp->scanned on,
+   * for the start command.
+   * Returns: stream offset of the command found, -1 when not found
+   */
+
+  const char *p = buf;
+  const char *end = buf + len;
+  const char *c;
+  ssize_t found;
+
+  /* continue a match started at the end of the previous block */
+
+  while ((sp->matched > 0) && (p < end))
+    {
+      if (*p != bjl_start_cmd[sp->matched])
+	{
+	  /* no match, command does not repeat its first byte, so */
+	  /* this byte is searched again below */
+
+	  sp->matched = 0;
+	  break;
+	}
+      p++;
+      if (++sp->matched == BJL_START_CMD_LEN)
+	{
+	  found = sp->scanned + (p - buf) - BJL_START_CMD_LEN;
+	  sp->matched = 0;
+	  sp->scanned += p - buf;
+	  return found;
+	}
+    }
+
+  while ((sp->matched == 0)
+	 && ((c = find_cmd_candidate (p, end)) < end))
     {
-      if ((buf[i] == lookfor[0]) && (memcmp (buf + i, lookfor, size) == 0))
+      if (end - c >= BJL_START_CMD_LEN)
+	{
+	  if (memcmp (c, bjl_start_cmd, BJL_START_CMD_LEN) == 0)
+	    {
+	      found = sp->scanned + (c - buf);
+	      sp->scanned = found + BJL_START_CMD_LEN;
+	      return found;
+	    }
+	}
+      else if (memcmp (c, bjl_start_cmd, end - c) == 0)
 	{
-	  return i;
+	  /* command may continue in next block */
+
+	  sp->matched = end - c;
+	  break;
 	}
+      p = c + 1;
     }
+
+  sp->scanned += len;
   return -1;
 }
 
+void
+bjnp_split_reset (bjnp_splitter_t * sp, ssize_t pos)
+{
+  /*
+   * (re)start searching the print stream for BJL commands at pos
+   */
+
+  if (find_cmd_candidate == NULL)
+    select_cmd_search ();
+
+  sp->scanned = pos;
+  sp->next_cmd = -1;
+  sp->matched = 0;
+  sp->last_cmd = -1;
+}
+
+ssize_t
+bjnp_split_next (bjnp_splitter_t * sp, const char *ring, size_t ring_size,
+		 ssize_t send_pos, ssize_t read_pos, int eof)
+{
+  /*
+   * Find the end of the next print packet, print data in the ring buffer 
+   * is addressed by stream offset. Only data that was not searched before
+   * is searched. Bytes at the end of the data that may be the start of a 
+   * command are held back until more data is read or eof is reached
+   * Returns: stream offset upto which data may be sent in one packet
+   */
+
+  size_t idx;
+  size_t len;
+
+  while ((sp->next_cmd <= send_pos) && (sp->scanned < read_pos))
+    {
+      if (sp->next_cmd >= 0)
+	sp->last_cmd = sp->next_cmd;
+      idx = sp->scanned % ring_size;
+      len = read_pos - sp->scanned;
+      if (len > ring_size - idx)
+	len = ring_size - idx;
+      sp->next_cmd = split_scan (sp, ring + idx, len);
+    }
+
+  if (sp->next_cmd > send_pos)
+    return sp->next_cmd;
+
+  return eof ? read_pos : read_pos - sp->matched;
+}
 
+int
+bjnp_split_at_cmd (bjnp_splitter_t * sp, ssize_t send_pos)
+{
+  /*
+   * Returns: 1 when the packet sent from send_pos starts with a command
+   */
 
+  return (sp->next_cmd == send_pos) || (sp->last_cmd == send_pos);
+}
 
 int
 set_cmd (struct BJNP_command *cmd, char cmd_code, int my_session_id,
@@ -236,107 +534,335 @@ set_cmd (struct BJNP_command *cmd, char cmd_code, int my_session_id,
 
 
 
-int
-udp_command (http_addr_t * addr, char *command, int cmd_len, char *response,
-	     int resp_len)
+static socklen_t
+addr_length (http_addr_t * addr)
+{
+/*
+ * Returns: size of the socket address
+ */
+
+#ifdef AF_INET6
+  if (addr->addr.sa_family == AF_INET6)
+    return sizeof (struct sockaddr_in6);
+#endif
+  return sizeof (struct sockaddr_in);
+}
+
+static char *
+addr_string (http_addr_t * addr, char *buf, socklen_t size)
+{
+/*
+ * Returns: numeric address as string in buf
+ */
+
+#ifdef AF_INET6
+  if (addr->addr.sa_family == AF_INET6)
+    return (char *) inet_ntop (AF_INET6, &addr->ipv6.sin6_addr, buf, size);
+#endif
+  return (char *) inet_ntop (AF_INET, &addr->ipv4.sin_addr, buf, size);
+}
+
+static long usec_since (struct timeval *start);
+
+static void
+status_drop (void)
 {
   /*
-   * Send UDP command and retrieve response
-   * Returns: length of response or -1 in case of error
+   * Forget the outstanding status query, a late response is dropped
    */
 
-  int sockfd;
-  int numbytes;
-  fd_set fdset;
-  struct timeval timeout;
-  int try;
+  if ((status_tries > 0) && (status_req >= 0))
+    ctl_req[status_req].in_use = 0;
+  status_tries = 0;
+  status_req = -1;
+}
 
-  bjnp_debug (LOG_DEBUG, "Sending UDP command to %s:%d\n",
-	      inet_ntoa (addr->ipv4.sin_addr), ntohs (addr->ipv4.sin_port));
+static void
+ctl_close (void)
+{
+  /*
+   * Close the control socket, requests waiting for a response are dropped
+   */
 
-  if ((sockfd = socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  int i;
+
+  if (ctl_fd != -1)
+    close (ctl_fd);
+  ctl_fd = -1;
+  for (i = 0; i < BJNP_CTL_MAX; i++)
+    ctl_req[i].in_use = 0;
+  status_tries = 0;
+  status_req = -1;
+}
+
+static int
+ctl_open (http_addr_t * addr)
+{
+  /*
+   * Get a control socket connected to addr. The socket of the print 
+   * session is used when it is connected to addr, otherwise it is 
+   * replaced by a new socket
+   * Returns: socket or -1 on error
+   */
+
+  int fd;
+
+  if ((ctl_fd != -1) && (memcmp (&ctl_addr, addr, addr_length (addr)) == 0))
+    return ctl_fd;
+
+  ctl_close ();
+
+  if ((fd = socket (addr->addr.sa_family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
     {
-      bjnp_debug (LOG_CRIT, "udp_command: sockfd - %s\n", strerror (errno));
+      bjnp_debug (LOG_CRIT, "ctl_open: sockfd - %s\n", strerror (errno));
       return -1;
     }
 
-  if (connect (sockfd, &(addr->addr), (socklen_t) sizeof (struct sockaddr_in))
-      != 0)
+  if ((connect (fd, &(addr->addr), addr_length (addr)) != 0)
+      || (fcntl (fd, F_SETFL, O_NONBLOCK) != 0))
     {
-      bjnp_debug (LOG_CRIT, "udp_command: connect - %s\n", strerror (errno));
+      bjnp_debug (LOG_CRIT, "ctl_open: connect - %s\n", strerror (errno));
+      close (fd);
       return -1;
     }
 
-  for (try = 0; try < 3; try++)
+  ctl_fd = fd;
+  ctl_addr = *addr;
+  return ctl_fd;
+}
+
+static void
+ctl_adopt (int fd, http_addr_t * addr)
+{
+  /*
+   * Make fd, a socket connected to addr, the control socket. When a 
+   * control socket is open its descriptor number is kept, so the run 
+   * loop can keep using it
+   */
+
+  int i;
+
+  for (i = 0; i < BJNP_CTL_MAX; i++)
+    ctl_req[i].in_use = 0;
+  status_tries = 0;
+  status_req = -1;
+
+  if (ctl_fd == -1)
+    ctl_fd = fd;
+  else
+    {
+      dup2 (fd, ctl_fd);
+      close (fd);
+    }
+  ctl_addr = *addr;
+}
+
+static int
+ctl_add (uint16_t seq, char *resp, int resp_max)
+{
+  /*
+   * Register a request that waits for a response with seq_no seq
+   * Returns: entry in ctl_req, -1 if too many requests are waiting
+   */
+
+  int i;
+
+  for (i = 0; i < BJNP_CTL_MAX; i++)
+    if (!ctl_req[i].in_use)
+      {
+	ctl_req[i].in_use = 1;
+	ctl_req[i].seq = seq;
+	ctl_req[i].resp = resp;
+	ctl_req[i].resp_max = resp_max;
+	ctl_req[i].resp_len = -1;
+	return i;
+      }
+  bjnp_debug (LOG_CRIT, "ctl_add: too many requests waiting\n");
+  return -1;
+}
+
+static int
+ctl_receive (void)
+{
+  /*
+   * Read all responses waiting on the control socket and hand them to the
+   * requests they belong to by seq_no. Other responses are dropped
+   * Returns: 0 = ok, -1 = error, errno is set
+   */
+
+  char buf[BJNP_RESP_MAX];
+  ssize_t len;
+  uint16_t seq;
+  int i;
+
+  while ((len = recv (ctl_fd, buf, sizeof (buf), 0)) > 0)
     {
-      if ((numbytes = send (sockfd, command, cmd_len, 0)) != cmd_len)
+      if (len < (ssize_t) sizeof (struct BJNP_command))
+	continue;
+
+      seq = ntohs (((struct BJNP_command *) buf)->seq_no);
+      for (i = 0; i < BJNP_CTL_MAX; i++)
+	if (ctl_req[i].in_use && (ctl_req[i].resp_len < 0)
+	    && (ctl_req[i].seq == seq))
+	  break;
+
+      if (i == BJNP_CTL_MAX)
 	{
-	  bjnp_debug (LOG_CRIT, "udp_command: Sent only %d bytes of packet",
-		      numbytes);
+	  bjnp_debug (LOG_DEBUG, "Dropped stale response %d\n", seq);
+	  continue;
 	}
 
+      if (len > ctl_req[i].resp_max)
+	len = ctl_req[i].resp_max;
+      memcpy (ctl_req[i].resp, buf, len);
+      ctl_req[i].resp_len = len;
+    }
+
+  if ((len < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)
+      && (errno != EINTR))
+    return -1;
+  return 0;
+}
 
-      FD_ZERO (&fdset);
-      FD_SET (sockfd, &fdset);
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+static long
+ctl_rto (int tries)
+{
+  /*
+   * Returns: retransmission timeout (usec) for a request that was sent 
+   *          tries times, from the measured round trip time (RFC 6298)
+   */
+
+  long rto = BJNP_RTO_INITIAL_USEC;
+
+  if (ctl_srtt > 0)
+    {
+      rto = ctl_srtt + 4 * ctl_rttvar;
+      if (rto < BJNP_RTO_MIN_USEC)
+	rto = BJNP_RTO_MIN_USEC;
+    }
+
+  /* back off for each resend */
+
+  while ((--tries > 0) && (rto < BJNP_RTO_MAX_USEC))
+    rto *= 2;
+  if (rto > BJNP_RTO_MAX_USEC)
+    rto = BJNP_RTO_MAX_USEC;
+  return rto;
+}
+
+static void
+ctl_rtt_sample (long rtt)
+{
+  /*
+   * Update the round trip time estimate. Only responses to requests that
+   * were sent once are used, as it is unknown which copy a response to a
+   * resent request belongs to (Karn's algorithm)
+   */
+
+  if (rtt <= 0)
+    rtt = 1;
+
+  if (ctl_srtt == 0)
+    {
+      ctl_srtt = rtt;
+      ctl_rttvar = rtt / 2;
+    }
+  else
+    {
+      ctl_rttvar = (3 * ctl_rttvar + labs (ctl_srtt - rtt)) / 4;
+      ctl_srtt = (7 * ctl_srtt + rtt) / 8;
+    }
+  bjnp_debug (LOG_DEBUG2, "Round trip time %ld usec, srtt %ld, rttvar %ld\n",
+	      rtt, ctl_srtt, ctl_rttvar);
+}
+
+int
+udp_command (http_addr_t * addr, char *command, int cmd_len, char *response,
+	     int resp_len)
+{
+  /*
+   * Send UDP command on the control socket and retrieve response. Other
+   * requests can be waiting for their response at the same time.
+   * Returns: length of response or -1 in case of error
+   */
+
+  int numbytes;
+  fd_set fdset;
+  struct timeval timeout;
+  struct timeval sent;
+  long wait;
+  int try;
+  int req;
+  char addrname[INET6_ADDRSTRLEN];
+
+  bjnp_debug (LOG_DEBUG, "Sending UDP command to %s:%d\n",
+	      addr_string (addr, addrname, sizeof (addrname)),
+	      ntohs (addr->ipv4.sin_port));
+
+  if ((ctl_open (addr) == -1)
+      || ((req = ctl_add (ntohs (((struct BJNP_command *) command)->seq_no),
+			  response, resp_len)) == -1))
+    return -1;
 
-      if (select (sockfd + 1, &fdset, NULL, NULL, &timeout) <= 0)
+  for (try = 1; (try <= BJNP_UDP_TRIES) && (ctl_req[req].resp_len < 0);
+       try++)
+    {
+      if ((numbytes = send (ctl_fd, command, cmd_len, 0)) != cmd_len)
 	{
-          /* no data recieved OR error, in either case retry */
-	  continue;
+	  bjnp_debug (LOG_CRIT, "udp_command: Sent only %d bytes of packet",
+		      numbytes);
 	}
+      gettimeofday (&sent, NULL);
 
-      if ((numbytes = recv (sockfd, response, resp_len, MSG_WAITALL)) == -1)
+      while ((ctl_req[req].resp_len < 0)
+	     && ((wait = ctl_rto (try) - usec_since (&sent)) > 0))
 	{
-	  bjnp_debug (LOG_CRIT, "udp_command: no data received (recv)");
-	  continue;
+	  FD_ZERO (&fdset);
+	  FD_SET (ctl_fd, &fdset);
+	  timeout.tv_sec = wait / 1000000;
+	  timeout.tv_usec = wait % 1000000;
+
+	  if ((select (ctl_fd + 1, &fdset, NULL, NULL, &timeout) > 0)
+	      && (ctl_receive () < 0))
+	    {
+	      bjnp_debug (LOG_CRIT, "udp_command: no data received (recv)");
+	      break;
+	    }
 	}
-      close (sockfd);
-      return numbytes;
+
+      if ((ctl_req[req].resp_len >= 0) && (try == 1))
+	ctl_rtt_sample (usec_since (&sent));
     }
-  /* max tries reached, return failure */
-  close (sockfd);
-  return -1;
+
+  numbytes = ctl_req[req].resp_len;
+  ctl_req[req].in_use = 0;
+  return numbytes;
 }
 
-void
-get_printer_id (http_addr_t * addrlist, char *model, char *IEEE1284_id)
+static void
+parse_printer_id (char *resp_buf, int resp_len, char *model,
+		  char *IEEE1284_id)
 {
   /*
-   * get printer identity
+   * Parse the response to an identity query
    * Sets model (make and model) and IEEE1284_id
    */
 
-  struct BJNP_command cmd;
   struct IDENTITY *id;
   char printer_id[BJNP_IEEE1284_MAX];
-  int resp_len;
   int id_len;
-  char resp_buf[BJNP_RESP_MAX];
-
-  /* set defaults */
-
-  strcpy (model, "Unidentified printer");
-  strcpy (IEEE1284_id, "");
-
-  set_cmd (&cmd, CMD_UDP_GET_ID, 0, 0);
-
-  bjnp_hexdump (LOG_DEBUG2, "Get printer identity", (char *) &cmd,
-		sizeof (struct BJNP_command));
-
-  resp_len =
-    udp_command (addrlist, (char *) &cmd, sizeof (struct BJNP_command),
-		 resp_buf, BJNP_RESP_MAX);
-
-  if (resp_len <= 0)
-    return;
 
   bjnp_hexdump (LOG_DEBUG2, "Printer identity:", resp_buf, resp_len);
 
   id = (struct IDENTITY *) resp_buf;
 
   id_len = ntohs (id->id_len) - sizeof (id->id_len);
+  if (id_len > resp_len - (int) offsetof (struct IDENTITY, id))
+    id_len = resp_len - (int) offsetof (struct IDENTITY, id);
+  if (id_len >= BJNP_IEEE1284_MAX)
+    id_len = BJNP_IEEE1284_MAX - 1;
+  if (id_len < 0)
+    id_len = 0;
 
   /* set IEEE1284_id */
 
@@ -357,11 +883,173 @@ get_printer_id (http_addr_t * addrlist, char *model, char *IEEE1284_id)
     }
 }
 
-bjnp_paper_status_t
-bjnp_get_paper_status (http_addrlist_t * addrlist)
+void
+get_printer_id (http_addr_t * addrlist, char *model, char *IEEE1284_id)
 {
   /*
-   * get printer paper status
+   * get printer identity
+   * Sets model (make and model) and IEEE1284_id
+   */
+
+  struct BJNP_command cmd;
+  int resp_len;
+  char resp_buf[BJNP_RESP_MAX];
+
+  /* set defaults */
+
+  strcpy (model, "Unidentified printer");
+  strcpy (IEEE1284_id, "");
+
+  set_cmd (&cmd, CMD_UDP_GET_ID, 0, 0);
+
+  bjnp_hexdump (LOG_DEBUG2, "Get printer identity", (char *) &cmd,
+		sizeof (struct BJNP_command));
+
+  resp_len =
+    udp_command (addrlist, (char *) &cmd, sizeof (struct BJNP_command),
+		 resp_buf, BJNP_RESP_MAX);
+
+  if (resp_len <= 0)
+    return;
+
+  parse_printer_id (resp_buf, resp_len, model, IEEE1284_id);
+}
+
+static void
+id_cache_name (char *name, size_t size)
+{
+  /*
+   * Get the name of the printer identity cache file
+   */
+
+  const char *tmpdir;
+
+  if ((tmpdir = getenv ("TMPDIR")) == NULL)
+    tmpdir = "/tmp";
+  snprintf (name, size, "%s/bjnp-id.cache", tmpdir);
+}
+
+static void
+mac_to_string (const char *mac, char *buf)
+{
+  /*
+   * Format a mac address as cache key, buf must hold 13 characters
+   */
+
+  int i;
+
+  for (i = 0; i < 6; i++)
+    sprintf (buf + 2 * i, "%02x", (unsigned char) mac[i]);
+}
+
+static int
+id_cache_lookup (const char *mac, char *model, char *IEEE1284_id)
+{
+  /*
+   * Find the identity of the printer with the given mac address in the
+   * identity cache. The cache has one line per printer: 
+   * mac <tab> time stored <tab> make and model <tab> IEEE1284 id
+   * Returns: 1 = found, 0 = found but older than BJNP_ID_CACHE_TTL, 
+   *          -1 = not found. model and IEEE1284_id are set when found
+   */
+
+  char name[1024];
+  char line[BJNP_MODEL_MAX + BJNP_IEEE1284_MAX + 64];
+  char key[13];
+  char *stamp;
+  char *cached_model;
+  char *cached_id;
+  FILE *fp;
+  int result = -1;
+
+  id_cache_name (name, sizeof (name));
+  if ((fp = fopen (name, "r")) == NULL)
+    return -1;
+
+  mac_to_string (mac, key);
+  while (fgets (line, sizeof (line), fp) != NULL)
+    {
+      if ((strncmp (line, key, 12) != 0) || (line[12] != '\t'))
+	continue;
+
+      line[strcspn (line, "\n")] = '\0';
+      if (((stamp = strtok (line + 13, "\t")) == NULL)
+	  || ((cached_model = strtok (NULL, "\t")) == NULL)
+	  || ((cached_id = strtok (NULL, "\t")) == NULL)
+	  || (strlen (cached_model) >= BJNP_MODEL_MAX)
+	  || (strlen (cached_id) >= BJNP_IEEE1284_MAX))
+	continue;
+
+      strcpy (model, cached_model);
+      strcpy (IEEE1284_id, cached_id);
+      result = (time (NULL) - atol (stamp) < BJNP_ID_CACHE_TTL) ? 1 : 0;
+      bjnp_debug (LOG_DEBUG, "Identity of %s found in cache%s\n", key,
+		  result ? "" : ", but it is too old");
+    }
+  fclose (fp);
+  return result;
+}
+
+static void
+id_cache_store (const char *mac, const char *model, const char *IEEE1284_id)
+{
+  /*
+   * Store the identity of the printer with the given mac address in the
+   * identity cache. The file is replaced as a whole, so readers never 
+   * see a partial update
+   */
+
+  char name[1024];
+  char tmpname[1040];
+  char line[BJNP_MODEL_MAX + BJNP_IEEE1284_MAX + 64];
+  char key[13];
+  FILE *in;
+  FILE *out;
+  int fd;
+
+  if ((IEEE1284_id[0] == '\0') || strchr (model, '\t')
+      || strchr (IEEE1284_id, '\t'))
+    return;
+
+  id_cache_name (name, sizeof (name));
+  snprintf (tmpname, sizeof (tmpname), "%s.XXXXXX", name);
+  if (((fd = mkstemp (tmpname)) < 0) || ((out = fdopen (fd, "w")) == NULL))
+    {
+      bjnp_debug (LOG_INFO, "Can not write identity cache: %s\n",
+		  strerror (errno));
+      if (fd >= 0)
+	{
+	  close (fd);
+	  unlink (tmpname);
+	}
+      return;
+    }
+  fchmod (fd, 0644);
+
+  mac_to_string (mac, key);
+  if ((in = fopen (name, "r")) != NULL)
+    {
+      while (fgets (line, sizeof (line), in) != NULL)
+	if (strncmp (line, key, 12) != 0)
+	  fputs (line, out);
+      fclose (in);
+    }
+  fprintf (out, "%s\t%ld\t%s\t%s\n", key, (long) time (NULL), model,
+	   IEEE1284_id);
+
+  if ((fclose (out) != 0) || (rename (tmpname, name) != 0))
+    {
+      bjnp_debug (LOG_INFO, "Can not write identity cache: %s\n",
+		  strerror (errno));
+      unlink (tmpname);
+    }
+}
+
+bjnp_paper_status_t
+bjnp_get_paper_status (http_addrlist_t * addrlist)
+{
+  /*
+   * get printer paper status
    */
 
   struct BJNP_command cmd;
@@ -394,18 +1082,31 @@ bjnp_get_paper_status (http_addrlist_t * addrlist)
 
 }
 
+int
+bjnp_printer_idle (http_addrlist_t * addr)
+{
+/*
+ * Query the printer status
+ * Returns: 1 when the printer is neither busy nor printing, 0 when it is,
+ *          -1 when the printer did not respond
+ */
+
+  printer_bst_valid = 0;
+  bjnp_get_paper_status (addr);
+  if (!printer_bst_valid)
+    return -1;
+  return (printer_bst & (BST_BUSY | BST_PRINTING)) == 0;
+}
+
 
 void
 get_printer_address (char *resp_buf, char *address, char *name)
 {
   /*
-   * Parse identify responses to ip-address
-   * and lookup hostname
+   * Parse identify responses to ip-address, name is set to the address
+   * until it is looked up by get_printer_name()
    */
 
-  struct in_addr ip_addr;
-  struct hostent *myhost;
-
   struct INIT_RESPONSE *init_resp;
 
   init_resp = (struct INIT_RESPONSE *) resp_buf;
@@ -416,379 +1117,1977 @@ get_printer_address (char *resp_buf, char *address, char *name)
 
   bjnp_debug (LOG_INFO, "Found printer at ip address: %s\n", address);
 
-  /* do reverse name lookup, if hostname can not be fouund return ip-address */
+  strcpy (name, address);
+}
+
+static void
+get_printer_name (const char *address, char *name)
+{
+  /*
+   * Do reverse name lookup, if hostname can not be found name is left
+   * unchanged. Can be called from several threads at once
+   */
 
-  inet_aton (address, &ip_addr);
-  myhost = gethostbyaddr (&ip_addr, sizeof (ip_addr), AF_INET);
+  struct sockaddr_in sa;
+  char host[256];
 
-  /* some buggy routers return noname if reverse lookup fails */
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  inet_aton (address, &sa.sin_addr);
 
-  if ((myhost == NULL) || (myhost->h_name == NULL) ||
-      (strncmp (myhost->h_name, "noname", 6) == 0))
+  /* some buggy routers return noname if reverse lookup fails */
 
-    /* no valid name found, so we will use the ip-address */
+  if ((getnameinfo ((struct sockaddr *) &sa, sizeof (sa), host, sizeof (host),
+		    NULL, 0, NI_NAMEREQD) == 0)
+      && (strncmp (host, "noname", 6) != 0))
 
-    strcpy (name, address);
-  else
     /* we received a name, so we will use it */
 
-    strcpy (name, myhost->h_name);
+    strcpy (name, host);
 }
 
+static unsigned int
+mac_hash (const char *mac)
+{
+  /*
+   * Hash a mac address (FNV-1a)
+   */
 
+  unsigned int hash = 2166136261u;
+  int i;
 
+  for (i = 0; i < 6; i++)
+    hash = (hash ^ (unsigned char) mac[i]) * 16777619u;
+  return hash;
+}
 
-int
-bjnp_send_broadcast (struct in_addr local_addr, struct in_addr broadcast_addr, 
-			struct BJNP_command cmd, int size)
+/* hash set of printers found, keyed by mac address */
+
+struct mac_set
+{
+  int *slot;			/* printer index per slot, -1 = empty */
+  unsigned int size;		/* nr of slots, 0 or a power of 2 */
+  unsigned int used;		/* nr of slots used */
+};
+
+static int
+seen_insert (struct mac_set *seen, struct printer_list *list, int index)
 {
   /*
-   * send command to interface and return open socket
+   * Add printer index of list to the set seen, the set grows to keep it 
+   * at most half full
+   * Returns: index of the printer with the same mac address that was seen 
+   *          before, -1 when added
    */
 
-  struct sockaddr_in locaddr;
-  struct sockaddr_in sendaddr;
-  int sockfd;
-  int broadcast = 1;
-  int numbytes;
-
+  unsigned int slot;
+  unsigned int size;
+  unsigned int i;
+  int *new_slot;
 
-  if ((sockfd = socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  if (2 * (seen->used + 1) > seen->size)
     {
-      bjnp_debug (LOG_CRIT, "discover_printer: sockfd - %s",
-		  strerror (errno));
-      return -1;
+      size = (seen->size == 0) ? 64 : 2 * seen->size;
+      if ((new_slot = malloc (size * sizeof (int))) == NULL)
+	{
+	  bjnp_debug (LOG_CRIT, "seen_insert: %s\n", strerror (errno));
+	  return -1;
+	}
+      for (i = 0; i < size; i++)
+	new_slot[i] = -1;
+
+      /* rehash */
+
+      for (i = 0; i < seen->size; i++)
+	if (seen->slot[i] != -1)
+	  {
+	    for (slot = mac_hash (list[seen->slot[i]].mac_addr) & (size - 1);
+		 new_slot[slot] != -1; slot = (slot + 1) & (size - 1));
+	    new_slot[slot] = seen->slot[i];
+	  }
+      free (seen->slot);
+      seen->slot = new_slot;
+      seen->size = size;
     }
 
-  /* Set broadcast flag on socket */
+  for (slot = mac_hash (list[index].mac_addr) & (seen->size - 1);
+       seen->slot[slot] != -1; slot = (slot + 1) & (seen->size - 1))
+    if (memcmp (list[seen->slot[slot]].mac_addr, list[index].mac_addr, 6)
+	== 0)
+      return seen->slot[slot];
+  seen->slot[slot] = index;
+  seen->used++;
+  return -1;
+}
 
-  if (setsockopt
-      (sockfd, SOL_SOCKET, SO_BROADCAST, (const char *) &broadcast,
-       sizeof (broadcast)) != 0)
-    {
-      bjnp_debug (LOG_CRIT, "discover_printer: setsockopts - %s",
-		  strerror (errno));
-      close (sockfd);
-      return -1;
-    };
+/* state of a printer found by bjnp_discover_printers() */
 
-  /* Bind to local address of interface, use BJNP printer port */
+struct discover_state
+{
+  uint16_t seq;			/* seq_no of identity query */
+  int tries;			/* nr of times it was sent, 0 = not pending */
+  struct timeval sent;		/* time it was last sent */
+  int named;			/* name lookup done? */
+  int reported;			/* passed to caller? */
+};
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * Reverse name lookups block, so they are done by name_worker() threads.
+ * The threads are detached: when discovery ends before a lookup is done,
+ * its result is dropped. Discovery runs only once per process.
+ */
 
-  memset (&locaddr, '\0', sizeof locaddr); 
-  locaddr.sin_family = AF_INET;
-  locaddr.sin_port = htons (BJNP_PORT_PRINT);
-  locaddr.sin_addr = local_addr;
+static struct
+{
+  pthread_mutex_t mutex;	/* protects this struct and list hostnames */
+  pthread_cond_t cond;		/* signals new printers or shutdown */
+  struct printer_list *list;	/* printers found */
+  int count;			/* nr of printers in list */
+  int next;			/* next printer to look up */
+  int shutdown;			/* discovery ended? */
+  int workers;			/* nr of running threads */
+  int pipe_fd[2];		/* nr of printer is written when its name */
+				/* is set */
+} names = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void *
+name_worker (void *arg)
+{
+  /*
+   * Look up the names of printers until discovery ends
+   */
 
-  if (bind
-      (sockfd, (struct sockaddr *) &locaddr,
-       (socklen_t) sizeof (locaddr)) != 0)
+  char address[16];
+  char name[256];
+  int i;
+
+  (void) arg;
+
+  pthread_mutex_lock (&names.mutex);
+  for (;;)
     {
-      bjnp_debug (LOG_CRIT, "discover_printer: bind - %s\n",
-		  strerror (errno));
-      close (sockfd);
-      return -1;
+      while (!names.shutdown && (names.next >= names.count))
+	pthread_cond_wait (&names.cond, &names.mutex);
+      if (names.shutdown)
+	break;
+
+      i = names.next++;
+      strcpy (address, names.list[i].ip_address);
+      pthread_mutex_unlock (&names.mutex);
+
+      strcpy (name, address);
+      get_printer_name (address, name);
+
+      pthread_mutex_lock (&names.mutex);
+      if (names.shutdown)
+	break;
+      strcpy (names.list[i].hostname, name);
+      if (write (names.pipe_fd[1], &i, sizeof (i)) != sizeof (i))
+	bjnp_debug (LOG_CRIT, "name_worker: %s\n", strerror (errno));
     }
 
-  /* set address to send packet to */
-  /* usebroadcast address of interface */
+  /* the last thread to stop closes the pipe */
 
-  memset (&sendaddr, '\0', sizeof sendaddr);
-  sendaddr.sin_family = AF_INET;
-  sendaddr.sin_port = htons (BJNP_PORT_PRINT);
-  sendaddr.sin_addr = broadcast_addr; 
+  if (--names.workers == 0)
+    {
+      close (names.pipe_fd[0]);
+      close (names.pipe_fd[1]);
+    }
+  pthread_mutex_unlock (&names.mutex);
+  return NULL;
+}
+#endif /* HAVE_PTHREAD_H */
+
+static int
+names_start (void)
+{
+  /*
+   * Start the threads for name lookups of printers found
+   * Returns: fd to read the nr of each printer named from, -1 when names
+   *          must be looked up by the caller
+   */
 
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  pthread_attr_t attr;
 
-  if ((numbytes = sendto (sockfd, &cmd, sizeof (struct BJNP_command), 0,
-			  (struct sockaddr *) &sendaddr, size)) != size)
+  if (pipe (names.pipe_fd) != 0)
+    return -1;
+  fcntl (names.pipe_fd[0], F_SETFL, O_NONBLOCK);
+
+  names.list = NULL;
+  names.count = 0;
+  names.next = 0;
+  names.shutdown = 0;
+  names.workers = 0;
+
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  while ((names.workers < BJNP_NAME_THREADS) &&
+	 (pthread_create (&thread, &attr, name_worker, NULL) == 0))
+    names.workers++;
+  pthread_attr_destroy (&attr);
+
+  if (names.workers == 0)
     {
-      bjnp_debug (LOG_DEBUG,
-		  "discover_printers: Sent only %d bytes of packet, error = %s\n",
-		  numbytes, strerror (errno));
-      /* not allowed, skip this interface */
-
-      close (sockfd);
+      close (names.pipe_fd[0]);
+      close (names.pipe_fd[1]);
       return -1;
     }
-  return sockfd;
+  return names.pipe_fd[0];
+#else
+  return -1;
+#endif /* HAVE_PTHREAD_H */
 }
 
-int
-bjnp_discover_printers (struct printer_list *list)
+static void
+names_add (int count)
 {
-  struct sockaddr_in sendaddr;
-  int numbytes = 0;
-  struct BJNP_command cmd;
-  int num_printers = 0;
-  char resp_buf[2048];
-  http_addr_t http_addr;
-#ifdef HAVE_GETIFADDRS
-  struct ifaddrs *interfaces;
-  struct ifaddrs *interface;
-  char addr[16];
-  char broadcast[16];
+  /*
+   * Tell the name lookup threads that list now holds count printers
+   */
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&names.mutex);
+  names.count = count;
+  pthread_cond_signal (&names.cond);
+  pthread_mutex_unlock (&names.mutex);
 #else
-  struct in_addr broadcast;
-  struct in_addr local;
-#endif
-  int socket_fd[BJNP_SOCK_MAX];
-  int no_sockets;
-  int i;
-  int last_socketfd = 0;
-  fd_set fdset;
-  fd_set active_fdset;
-  struct timeval timeout;
+  (void) count;
+#endif /* HAVE_PTHREAD_H */
+}
 
-  FD_ZERO (&fdset);
+static void
+names_stop (void)
+{
+  /*
+   * Stop the name lookup threads, lookups in progress are dropped
+   */
 
-  set_cmd (&cmd, CMD_UDP_DISCOVER, 0, 0);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&names.mutex);
+  names.shutdown = 1;
+  pthread_cond_broadcast (&names.cond);
+  pthread_mutex_unlock (&names.mutex);
+#endif /* HAVE_PTHREAD_H */
+}
 
-#ifdef HAVE_GETIFADDRS
+static struct printer_list *
+names_grow (struct printer_list *list, int size)
+{
+  /*
+   * Resize list to size printers while no name lookup thread uses it
+   * Returns: the resized list, NULL on error (list is unchanged)
+   */
+
+  struct printer_list *new_list;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&names.mutex);
+#endif /* HAVE_PTHREAD_H */
+  if ((new_list = realloc (list, size * sizeof (*list))) != NULL)
+    {
+#ifdef HAVE_PTHREAD_H
+      names.list = new_list;
+#endif /* HAVE_PTHREAD_H */
+    }
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&names.mutex);
+#endif /* HAVE_PTHREAD_H */
+  return new_list;
+}
 
+static void
+send_id_query (int sockfd, struct printer_list *printer,
+	       struct discover_state *st)
+{
   /*
-   * Send UDP broadcast to discover printers and return the list of printers found
-   * Returns: number of printers found
+   * Send an identity query to a printer found by discovery, a resent 
+   * query keeps its seq_no
    */
 
-  getifaddrs (&interfaces);
-  interface = interfaces;
+  struct BJNP_command cmd;
+  struct sockaddr_in addr;
 
-  for (no_sockets = 0; (no_sockets < BJNP_SOCK_MAX) && (interface != NULL);)
+  if (st->tries == 0)
+    st->seq = set_cmd (&cmd, CMD_UDP_GET_ID, 0, 0);
+  else
     {
-      /* send broadcast packet to each suitable  interface */
+      set_cmd (&cmd, CMD_UDP_GET_ID, 0, 0);
+      cmd.seq_no = htons (st->seq);
+    }
 
-      if ((interface->ifa_addr == NULL) || (interface->ifa_broadaddr == NULL) ||
-          (interface->ifa_addr->sa_family != AF_INET) ||
-          (((struct sockaddr_in *) interface->ifa_addr)->sin_addr.s_addr ==
-           htonl(INADDR_LOOPBACK)))
-        {
-          /* not an IPv4 capable interface */
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (printer->port);
+  inet_aton (printer->ip_address, &addr.sin_addr);
 
-         bjnp_debug(LOG_DEBUG, "%s is not a valid IPv4 interface, skipping...\n",
-                 interface->ifa_name);
-        }
-    else    
-      {
-        strcpy(addr, inet_ntoa (((struct sockaddr_in *) interface->ifa_addr)->sin_addr));
-        strcpy(broadcast, inet_ntoa (((struct sockaddr_in *) interface->ifa_broadaddr)->sin_addr));
-        bjnp_debug(LOG_DEBUG, "%s is IPv4 capable, sending broadcast from %s to %s.\n",
-                 interface->ifa_name, addr, broadcast);
-          
-      if ((socket_fd[no_sockets] =
-	   bjnp_send_broadcast (((struct sockaddr_in *) interface->
-                                     ifa_addr)->sin_addr, 
-				((struct sockaddr_in *) interface->
-                                     ifa_broadaddr)->sin_addr, 
-				     cmd, sizeof (cmd))) != -1)
+  if (sendto (sockfd, &cmd, sizeof (cmd), 0, (struct sockaddr *) &addr,
+	      sizeof (addr)) != sizeof (cmd))
+    bjnp_debug (LOG_INFO, "send_id_query: %s\n", strerror (errno));
+  gettimeofday (&st->sent, NULL);
+  st->tries++;
+}
 
-	{
-	  if (socket_fd[no_sockets] > last_socketfd)
-	    {
-	      /* track highest used socket for use in select */
+static void
+read_id_responses (int sockfd, struct printer_list *list,
+		   struct discover_state *st, int num_printers)
+{
+  /*
+   * Read responses to identity queries and match them to the printers 
+   * by seq_no
+   */
 
-	      last_socketfd = socket_fd[no_sockets];
-	    }
-	  FD_SET (socket_fd[no_sockets], &fdset);
-	  no_sockets++;
-	}
-       }
-      interface = interface->ifa_next;
-    }
-  freeifaddrs (interfaces);
-#else
- /* 
-  * we do not have getifaddrs(), so there is no easy way to find all interfaces
-  * with teir broadcast addresses. We use a single global broadcast instead
-  */
-  no_sockets = 0;
-  broadcast.s_addr = htonl(INADDR_BROADCAST);
-  local.s_addr = htonl(INADDR_ANY);
+  char resp_buf[BJNP_RESP_MAX];
+  ssize_t resp_len;
+  uint16_t seq;
+  int i;
 
-  if ((socket_fd[no_sockets] =
-       bjnp_send_broadcast (local, broadcast, cmd, sizeof (cmd))) != -1)
+  while ((resp_len = recv (sockfd, resp_buf, sizeof (resp_buf), 0)) > 0)
     {
-      if (socket_fd[no_sockets] > last_socketfd)
-        {
-          /* track highest used socket for use in select */
+      if (resp_len < (ssize_t) sizeof (struct BJNP_command))
+	continue;
 
-          last_socketfd = socket_fd[no_sockets];
-        }
-      FD_SET (socket_fd[no_sockets], &fdset);
-      no_sockets++;
-    }
-#endif
+      seq = ntohs (((struct BJNP_command *) resp_buf)->seq_no);
+      for (i = 0; i < num_printers; i++)
+	if ((st[i].tries > 0) && (st[i].seq == seq))
+	  break;
+      if (i == num_printers)
+	continue;
 
-  /* wait for up to 1 second for a UDP response */
+      if (st[i].tries == 1)
+	ctl_rtt_sample (usec_since (&st[i].sent));
+      st[i].tries = 0;
 
-  timeout.tv_sec = 1;
-  timeout.tv_usec = 0;
+      parse_printer_id (resp_buf, resp_len, list[i].model,
+			list[i].IEEE1284_id);
+      id_cache_store (list[i].mac_addr, list[i].model, list[i].IEEE1284_id);
+    }
+}
 
-  active_fdset = fdset;
 
-  while (select (last_socketfd + 1, &active_fdset, NULL, NULL, &timeout) > 0)
-    {
-      bjnp_debug (LOG_DEBUG, "Select returned, time left %d.%d....\n",
-		  timeout.tv_sec, timeout.tv_usec);
 
-      for (i = 0; i < no_sockets; i++)
-	{
-	  if (FD_ISSET (socket_fd[i], &active_fdset))
-	    {
-	      if ((numbytes =
-		   recv (socket_fd[i], resp_buf, sizeof (resp_buf),
-			 MSG_WAITALL)) == -1)
-		{
-		  bjnp_debug (LOG_CRIT,
-			      "discover_printers: no data received");
-		  break;
-		}
-	      else
-		{
 
-		  bjnp_hexdump (LOG_DEBUG2, "Discover response:", &resp_buf,
-				numbytes);
+/* interface a discover broadcast is sent on */
 
+struct discover_if
+{
+  char name[IF_NAMESIZE];	/* interface name */
+  unsigned int index;		/* interface index, 0 = any */
+  struct in_addr local;		/* address of interface */
+  struct in_addr broadcast;	/* broadcast address of interface */
+};
+
+static int
+if_listed (const char *patterns, const char *name)
+{
+  /*
+   * Check if name matches one of the comma separated shell patterns
+   * Returns: 1 if it matches, 0 otherwise
+   */
 
-		  /* check if ip-address of printer is returned */
+  char pattern[256];
+  size_t len;
 
-		  if ((numbytes != sizeof (struct INIT_RESPONSE))
-		      || (strncmp ("BJNP", resp_buf, 4) != 0))
-		    {
-		      /* printer not found */
-		      break;
-		    }
-		};
+  while (*patterns != '\0')
+    {
+      len = strcspn (patterns, ", ");
+      if ((len > 0) && (len < sizeof (pattern)))
+	{
+	  memcpy (pattern, patterns, len);
+	  pattern[len] = '\0';
+	  if (fnmatch (pattern, name, 0) == 0)
+	    return 1;
+	}
+      patterns += len;
+      patterns += strspn (patterns, ", ");
+    }
+  return 0;
+}
+
+static int
+if_selected (const char *name)
+{
+  /*
+   * Check if discovery may use an interface according to the include and
+   * exclude lists set by bjnp_set_discover_interfaces()
+   * Returns: 1 if interface is used, 0 otherwise
+   */
+
+  if ((discover_include != NULL) && !if_listed (discover_include, name))
+    return 0;
+  if ((discover_exclude != NULL) && if_listed (discover_exclude, name))
+    return 0;
+  return 1;
+}
+
+static int
+list_interfaces (struct discover_if **ifs)
+{
+  /*
+   * Find the IPv4 interfaces to send discover broadcasts on
+   * Returns: nr of interfaces in ifs (to be freed by caller)
+   */
+
+  struct discover_if *new_ifs;
+  int num_ifs = 0;
+  int max_ifs = 0;
+#ifdef HAVE_GETIFADDRS
+  struct ifaddrs *interfaces;
+  struct ifaddrs *interface;
+  char addr[16];
+  char broadcast[16];
+
+  *ifs = NULL;
+  if (getifaddrs (&interfaces) != 0)
+    {
+      bjnp_debug (LOG_CRIT, "discover_printers: getifaddrs - %s\n",
+		  strerror (errno));
+      return 0;
+    }
+
+  for (interface = interfaces; interface != NULL;
+       interface = interface->ifa_next)
+    {
+      if ((interface->ifa_addr == NULL) || (interface->ifa_broadaddr == NULL) ||
+          (interface->ifa_addr->sa_family != AF_INET) ||
+          (((struct sockaddr_in *) interface->ifa_addr)->sin_addr.s_addr ==
+           htonl(INADDR_LOOPBACK)))
+        {
+          /* not an IPv4 capable interface */
+
+         bjnp_debug(LOG_DEBUG, "%s is not a valid IPv4 interface, skipping...\n",
+                 interface->ifa_name);
+         continue;
+        }
+      if (!if_selected (interface->ifa_name))
+	{
+	  bjnp_debug (LOG_DEBUG, "%s is not selected, skipping...\n",
+		      interface->ifa_name);
+	  continue;
+	}
+
+      if (num_ifs == max_ifs)
+	{
+	  max_ifs = (max_ifs == 0) ? 16 : 2 * max_ifs;
+	  if ((new_ifs = realloc (*ifs, max_ifs * sizeof (**ifs))) == NULL)
+	    {
+	      bjnp_debug (LOG_CRIT, "discover_printers: %s\n", strerror (errno));
+	      break;
+	    }
+	  *ifs = new_ifs;
+	}
+
+      strncpy ((*ifs)[num_ifs].name, interface->ifa_name, IF_NAMESIZE - 1);
+      (*ifs)[num_ifs].name[IF_NAMESIZE - 1] = '\0';
+      (*ifs)[num_ifs].index = if_nametoindex (interface->ifa_name);
+      (*ifs)[num_ifs].local =
+	((struct sockaddr_in *) interface->ifa_addr)->sin_addr;
+      (*ifs)[num_ifs].broadcast =
+	((struct sockaddr_in *) interface->ifa_broadaddr)->sin_addr;
+
+      strcpy(addr, inet_ntoa ((*ifs)[num_ifs].local));
+      strcpy(broadcast, inet_ntoa ((*ifs)[num_ifs].broadcast));
+      bjnp_debug(LOG_DEBUG, "%s is IPv4 capable, sending broadcast from %s to %s.\n",
+                 interface->ifa_name, addr, broadcast);
+      num_ifs++;
+    }
+  freeifaddrs (interfaces);
+#else
+ /* 
+  * we do not have getifaddrs(), so there is no easy way to find all interfaces
+  * with teir broadcast addresses. We use a single global broadcast instead
+  */
+
+  (void) new_ifs;
+  (void) max_ifs;
+  if ((*ifs = malloc (sizeof (**ifs))) == NULL)
+    return 0;
+  strcpy ((*ifs)[0].name, "any");
+  (*ifs)[0].index = 0;
+  (*ifs)[0].local.s_addr = htonl (INADDR_ANY);
+  (*ifs)[0].broadcast.s_addr = htonl (INADDR_BROADCAST);
+  num_ifs = 1;
+#endif
+  return num_ifs;
+}
+
+static int
+open_discover_socket (void)
+{
+  /*
+   * open the socket that discover broadcasts are sent from on all 
+   * interfaces, bound to the BJNP printer port
+   * Returns: open socket, -1 on error
+   */
+
+  struct sockaddr_in locaddr;
+  int sockfd;
+  int broadcast = 1;
+#ifdef IP_PKTINFO
+  int pktinfo = 1;
+#endif
+
+  if ((sockfd = socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    {
+      bjnp_debug (LOG_CRIT, "discover_printer: sockfd - %s",
+		  strerror (errno));
+      return -1;
+    }
+
+  /* Set broadcast flag on socket */
+
+  if (setsockopt
+      (sockfd, SOL_SOCKET, SO_BROADCAST, (const char *) &broadcast,
+       sizeof (broadcast)) != 0)
+    {
+      bjnp_debug (LOG_CRIT, "discover_printer: setsockopts - %s",
+		  strerror (errno));
+      close (sockfd);
+      return -1;
+    };
+
+#ifdef IP_PKTINFO
+  /* receive the interface each response arrived on */
+
+  if (setsockopt (sockfd, IPPROTO_IP, IP_PKTINFO, &pktinfo,
+		  sizeof (pktinfo)) != 0)
+    bjnp_debug (LOG_INFO, "discover_printer: IP_PKTINFO - %s\n",
+		strerror (errno));
+#endif
+
+  /* Bind to any local address, use BJNP printer port */
+
+  memset (&locaddr, '\0', sizeof locaddr); 
+  locaddr.sin_family = AF_INET;
+  locaddr.sin_port = htons (BJNP_PORT_PRINT);
+  locaddr.sin_addr.s_addr = htonl (INADDR_ANY);
+
+  if (bind
+      (sockfd, (struct sockaddr *) &locaddr,
+       (socklen_t) sizeof (locaddr)) != 0)
+    {
+      bjnp_debug (LOG_CRIT, "discover_printer: bind - %s\n",
+		  strerror (errno));
+      close (sockfd);
+      return -1;
+    }
+  fcntl (sockfd, F_SETFL, O_NONBLOCK);
+  return sockfd;
+}
+
+static void
+send_discover (int sockfd, struct discover_if *ifp, struct BJNP_command *cmd)
+{
+  /*
+   * send discover command to the broadcast address of an interface. The
+   * interface and source address are set per packet with IP_PKTINFO, so
+   * one socket serves all interfaces
+   */
+
+  struct sockaddr_in sendaddr;
+  struct msghdr msg;
+  struct iovec iov;
+#ifdef IP_PKTINFO
+  char control[CMSG_SPACE (sizeof (struct in_pktinfo))];
+  struct cmsghdr *cmsg;
+  struct in_pktinfo *pktinfo;
+#endif
+
+  memset (&sendaddr, '\0', sizeof sendaddr);
+  sendaddr.sin_family = AF_INET;
+  sendaddr.sin_port = htons (BJNP_PORT_PRINT);
+  sendaddr.sin_addr = ifp->broadcast;
+
+  iov.iov_base = cmd;
+  iov.iov_len = sizeof (struct BJNP_command);
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_name = &sendaddr;
+  msg.msg_namelen = sizeof (sendaddr);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+#ifdef IP_PKTINFO
+  if (ifp->index != 0)
+    {
+      memset (control, 0, sizeof (control));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+      cmsg = CMSG_FIRSTHDR (&msg);
+      cmsg->cmsg_level = IPPROTO_IP;
+      cmsg->cmsg_type = IP_PKTINFO;
+      cmsg->cmsg_len = CMSG_LEN (sizeof (struct in_pktinfo));
+      pktinfo = (struct in_pktinfo *) CMSG_DATA (cmsg);
+      pktinfo->ipi_ifindex = ifp->index;
+      pktinfo->ipi_spec_dst = ifp->local;
+    }
+#endif
+
+  if (sendmsg (sockfd, &msg, 0) != sizeof (struct BJNP_command))
+    {
+      /* not allowed, skip this interface */
+
+      bjnp_debug (LOG_DEBUG,
+		  "discover_printers: Sending to %s failed, error = %s\n",
+		  ifp->name, strerror (errno));
+    }
+}
+
+static ssize_t
+recv_discover (int sockfd, char *buf, size_t size, unsigned int *ifindex)
+{
+  /*
+   * receive a response to a discover broadcast
+   * Returns: size of response, -1 on error. ifindex is set to the index of
+   *          the interface it arrived on, 0 if not known
+   */
+
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t numbytes;
+#ifdef IP_PKTINFO
+  char control[CMSG_SPACE (sizeof (struct in_pktinfo))];
+  struct cmsghdr *cmsg;
+#endif
+
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+#ifdef IP_PKTINFO
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+#endif
+
+  *ifindex = 0;
+  if ((numbytes = recvmsg (sockfd, &msg, 0)) == -1)
+    return -1;
+
+#ifdef IP_PKTINFO
+  for (cmsg = CMSG_FIRSTHDR (&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if ((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_PKTINFO))
+      *ifindex = ((struct in_pktinfo *) CMSG_DATA (cmsg))->ipi_ifindex;
+#endif
+  return numbytes;
+}
+
+int
+bjnp_discover_printers (struct printer_list **list, bjnp_found_t found,
+			int expected, long deadline)
+{
+  /*
+   * Send UDP broadcast to discover printers and return the list of printers found
+   * The list is allocated here and must be freed by the caller. 
+   * Each printer is passed to found as soon as its name and identity are 
+   * known. Discovery ends 1 second after the last printer responded, after 
+   * deadline usec (0 = no deadline) or when expected printers (0 = any 
+   * number) are reported
+   * Returns: number of printers found
+   */
+
+  ssize_t numbytes;
+  struct BJNP_command cmd;
+  int num_printers = 0;
+  int max_printers = 0;
+  int size;
+  char resp_buf[BJNP_RESP_MAX];
+  struct discover_if *ifs;
+  int num_ifs;
+  int sockfd;
+  unsigned int ifindex;
+  char ifname[IF_NAMESIZE];
+  int i;
+  fd_set fdset;
+  struct timeval timeout;
+  struct printer_list *new_list;
+  struct discover_state *st = NULL;
+  struct discover_state *new_st;
+  struct mac_set seen = { NULL, 0, 0 };
+  int reported = 0;
+  int id_fd;
+  int name_fd;
+  int last_fd;
+  long wait;
+  long round_wait;
+  struct timeval start;
+  struct timeval last_reply;
+  struct timeval last_round;
+  int round = 1;
+
+  *list = NULL;
+  set_cmd (&cmd, CMD_UDP_DISCOVER, 0, 0);
+
+  if ((sockfd = open_discover_socket ()) == -1)
+    return 0;
+  num_ifs = list_interfaces (&ifs);
+  for (i = 0; i < num_ifs; i++)
+    send_discover (sockfd, &ifs[i], &cmd);
+
+  if ((id_fd = socket (PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+    bjnp_debug (LOG_CRIT, "discover_printers: %s\n", strerror (errno));
+  else
+    fcntl (id_fd, F_SETFL, O_NONBLOCK);
+  name_fd = names_start ();
+
+  gettimeofday (&start, NULL);
+  last_reply = start;
+  last_round = start;
+
+  for (;;)
+    {
+      /* report printers as soon as their name and identity are known */
+
+      for (i = 0; (i < num_printers) &&
+	   ((expected <= 0) || (reported < expected)); i++)
+	if (!st[i].reported && st[i].named && (st[i].tries == 0))
+	  {
+	    if (found != NULL)
+	      found (&(*list)[i]);
+	    st[i].reported = 1;
+	    reported++;
+	  }
+
+      if ((expected > 0) && (reported >= expected))
+	break;
+      if ((deadline > 0) && (usec_since (&start) >= deadline))
+	break;
+
+      /* 
+       * broadcast again to allow for packet loss, the time between rounds
+       * doubles each round
+       */
+
+      if ((round < discover_rounds) &&
+	  (usec_since (&last_round) >=
+	   (long) BJNP_DISCOVER_SPACING_USEC << (round - 1)))
+	{
+	  bjnp_debug (LOG_DEBUG, "Sending discover round %d\n", round + 1);
+	  for (i = 0; i < num_ifs; i++)
+	    send_discover (sockfd, &ifs[i], &cmd);
+	  gettimeofday (&last_round, NULL);
+	  round++;
+	}
+
+      /* 
+       * wait until the next round is due. After the last round, wait for 
+       * responses for up to 1 second after the last printer was found and
+       * at least as long as a next round would be spaced. Then wait until
+       * all printers found are reported
+       */
+
+      round_wait = ((long) BJNP_DISCOVER_SPACING_USEC << (round - 1)) -
+	usec_since (&last_round);
+      if (round < discover_rounds)
+	wait = round_wait;
+      else
+	{
+	  if ((wait = BJNP_DISCOVER_IDLE_USEC - usec_since (&last_reply)) <
+	      round_wait)
+	    wait = round_wait;
+	  if (wait <= 0)
+	    {
+	      if (reported == num_printers)
+		break;
+	      wait = BJNP_RTO_MAX_USEC;
+	    }
+	}
+      for (i = 0; i < num_printers; i++)
+	if ((st[i].tries > 0)
+	    && (ctl_rto (st[i].tries) - usec_since (&st[i].sent) < wait))
+	  wait = ctl_rto (st[i].tries) - usec_since (&st[i].sent);
+      if ((deadline > 0) && (deadline - usec_since (&start) < wait))
+	wait = deadline - usec_since (&start);
+      if (wait < 0)
+	wait = 0;
+
+      FD_ZERO (&fdset);
+      FD_SET (sockfd, &fdset);
+      last_fd = sockfd;
+      if (id_fd != -1)
+	{
+	  FD_SET (id_fd, &fdset);
+	  if (id_fd > last_fd)
+	    last_fd = id_fd;
+	}
+      if (name_fd != -1)
+	{
+	  FD_SET (name_fd, &fdset);
+	  if (name_fd > last_fd)
+	    last_fd = name_fd;
+	}
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_usec = wait % 1000000;
+
+      if (select (last_fd + 1, &fdset, NULL, NULL, &timeout) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  bjnp_debug (LOG_CRIT, "discover_printers: select failed: %s\n",
+		      strerror (errno));
+	  break;
+	}
+
+      while (FD_ISSET (sockfd, &fdset) &&
+	     ((numbytes = recv_discover (sockfd, resp_buf, sizeof (resp_buf),
+					 &ifindex)) != -1))
+	{
+	  bjnp_hexdump (LOG_DEBUG2, "Discover response:", &resp_buf, numbytes);
+
+	  /* check if ip-address of printer is returned */
+
+	  if ((numbytes != sizeof (struct INIT_RESPONSE))
+	      || (strncmp ("BJNP", resp_buf, 4) != 0))
+	    {
+	      /* printer not found */
+	      continue;
+	    }
+
+	  /* 
+	   * the socket receives on all interfaces, drop responses that 
+	   * arrive on an interface that is not selected
+	   */
+
+	  strcpy (ifname, "?");
+	  if ((ifindex != 0) && (if_indextoname (ifindex, ifname) != NULL) &&
+	      !if_selected (ifname))
+	    continue;
+
+	  if (num_printers == max_printers)
+	    {
+	      size = (max_printers == 0) ? 16 : 2 * max_printers;
+	      if ((new_list = names_grow (*list, size)) != NULL)
+		*list = new_list;
+	      if ((new_st = realloc (st, size * sizeof (*st))) != NULL)
+		st = new_st;
+	      if ((new_list == NULL) || (new_st == NULL))
+		{
+		  bjnp_debug (LOG_CRIT, "discover_printers: %s\n",
+			      strerror (errno));
+		  continue;
+		}
+	      max_printers = size;
+	    }
+
+	  /* 
+	   * printers answer each round and may be seen on more than one 
+	   * interface, so only the first response per mac address is used
+	   */
+
+	  memcpy ((*list)[num_printers].mac_addr,
+		  ((struct INIT_RESPONSE *) resp_buf)->mac_addr,
+		  sizeof ((*list)[num_printers].mac_addr));
+	  if (seen_insert (&seen, *list, num_printers) != -1)
+	    continue;
+
+	  memset (&st[num_printers], 0, sizeof (*st));
+	  gettimeofday (&last_reply, NULL);
+
+	  /* 
+	   * printer found, get IP-address. Its identity is taken from the 
+	   * cache or queried, its name is looked up in the background
+	   */
+
+	  get_printer_address (resp_buf, (*list)[num_printers].ip_address,
+			       (*list)[num_printers].hostname);
+	  (*list)[num_printers].port = BJNP_PORT_PRINT;
+	  bjnp_debug (LOG_DEBUG, "Printer %s found on %s\n",
+		      (*list)[num_printers].ip_address, ifname);
+
+	  if (id_cache_lookup ((*list)[num_printers].mac_addr,
+			       (*list)[num_printers].model,
+			       (*list)[num_printers].IEEE1284_id) != 1)
+	    {
+	      strcpy ((*list)[num_printers].model, "Unidentified printer");
+	      strcpy ((*list)[num_printers].IEEE1284_id, "");
+	      if (id_fd != -1)
+		send_id_query (id_fd, &(*list)[num_printers],
+			       &st[num_printers]);
+	    }
+	  num_printers++;
+
+	  if (name_fd != -1)
+	    names_add (num_printers);
+	  else
+	    {
+	      get_printer_name ((*list)[num_printers - 1].ip_address,
+				(*list)[num_printers - 1].hostname);
+	      st[num_printers - 1].named = 1;
+	    }
+	}
+
+      if ((id_fd != -1) && FD_ISSET (id_fd, &fdset))
+	read_id_responses (id_fd, *list, st, num_printers);
+
+      if ((name_fd != -1) && FD_ISSET (name_fd, &fdset))
+	while (read (name_fd, &i, sizeof (i)) == sizeof (i))
+	  st[i].named = 1;
+
+      /* resend identity queries that timed out */
+
+      for (i = 0; i < num_printers; i++)
+	{
+	  if ((st[i].tries == 0)
+	      || (usec_since (&st[i].sent) < ctl_rto (st[i].tries)))
+	    continue;
+
+	  if (st[i].tries >= BJNP_UDP_TRIES)
+	    {
+	      bjnp_debug (LOG_INFO, "No identity received from %s\n",
+			  (*list)[i].ip_address);
+	      st[i].tries = 0;
+	    }
+	  else
+	    send_id_query (id_fd, &(*list)[i], &st[i]);
+	}
+    }
+  bjnp_debug (LOG_DEBUG, "printer discovery finished after %ld ms...\n",
+	      usec_since (&start) / 1000);
+
+  /* 
+   * report printers that are incomplete when discovery ends, unless the
+   * expected printers were found
+   */
+
+  if (name_fd != -1)
+    names_stop ();
+  if ((expected <= 0) || (reported < expected))
+    for (i = 0; i < num_printers; i++)
+      if (!st[i].reported && (found != NULL))
+	found (&(*list)[i]);
+
+  close (sockfd);
+  if (id_fd != -1)
+    close (id_fd);
+  free (ifs);
+  free (st);
+  free (seen.slot);
+
+  return num_printers;
+}
+
+/* state of one address tried by bjnp_start_job() */
+
+struct job_attempt
+{
+  http_addrlist_t *addr;	/* address tried */
+  int udp_fd;			/* socket for job details, -1 if closed */
+  int tcp_fd;			/* print connection, -1 if closed */
+  int connected;		/* print connection established? */
+  int session;			/* session id, -1 if no response yet */
+  int tries;			/* nr of times job details were sent */
+  struct timeval sent;		/* time job details were last sent */
+  int have_mac;			/* mac address received? */
+  char mac[6];			/* mac address of printer */
+};
+
+static void
+reset_job_state (void)
+{
+/*
+ * Reset the print state at the start of a print session
+ */
+
+  slot_head = 0;
+  slots_used = 0;
+  rejecting = 0;
+  rejected_retired = 0;
+  cur_window = window_size;
+  throttle_delay = 0;
+  throttle_active = 0;
+  throttle_count = 0;
+  throttle_msec = 0;
+  timerclear (&throttle_until);
+  printer_bst_valid = 0;
+  ack_len = 0;
+  window_reset = 0;
+  io_syscalls = 0;
+  io_acked = 0;
+  if (chunk_auto)
+    {
+      /* probe again for every job */
+
+      chunk_size = BJNP_PRINTBUF_MAX;
+      chunk_good = BJNP_PRINTBUF_MAX;
+      chunk_probe_ok = 0;
+      chunk_probing = 1;
+    }
+}
+
+static void
+close_attempt (struct job_attempt *at, int end_session)
+{
+/*
+ * Close the sockets of an attempt, when end_session is set a session
+ * the printer opened for it is closed as well
+ */
+
+  struct BJNP_command cmd;
+
+  if ((at->udp_fd != -1) && end_session && (at->session >= 0))
+    {
+      set_cmd (&cmd, CMD_UDP_CLOSE, at->session, 0);
+      send (at->udp_fd, &cmd, sizeof (cmd), 0);
+    }
+  if (at->udp_fd != -1)
+    close (at->udp_fd);
+  if (at->tcp_fd != -1)
+    close (at->tcp_fd);
+  at->udp_fd = -1;
+  at->tcp_fd = -1;
+}
+
+static int
+start_attempt (struct job_attempt *at, http_addrlist_t * addr,
+	       char *cmd_buf, int cmd_len)
+{
+/*
+ * Send the job details and an identity query to addr and start to 
+ * connect to its print port, without waiting for the printer
+ * Returns: 0 = started, -1 = error, errno is set
+ */
+
+  struct BJNP_command cmd;
+  int family = addr->addr.addr.sa_family;
+
+  at->addr = addr;
+  at->udp_fd = -1;
+  at->tcp_fd = -1;
+  at->connected = 0;
+  at->session = -1;
+  at->tries = 1;
+  at->have_mac = 0;
+
+  if (((at->udp_fd = socket (family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+      || (connect (at->udp_fd, &addr->addr.addr, addr_length (&addr->addr))
+	  != 0)
+      || (fcntl (at->udp_fd, F_SETFL, O_NONBLOCK) != 0)
+      || ((at->tcp_fd = socket (family, SOCK_STREAM, 0)) == -1)
+      || (fcntl (at->tcp_fd, F_SETFL, O_NONBLOCK) != 0))
+    {
+      bjnp_debug (LOG_CRIT, "start_attempt: socket - %s\n", strerror (errno));
+      close_attempt (at, 0);
+      return -1;
+    }
+  fcntl (at->tcp_fd, F_SETFD, FD_CLOEXEC);
+
+  if (connect (at->tcp_fd, &addr->addr.addr, addr_length (&addr->addr)) == 0)
+    at->connected = 1;
+  else if (errno != EINPROGRESS)
+    {
+      bjnp_debug (LOG_INFO, "start_attempt: connect - %s\n",
+		  strerror (errno));
+      close_attempt (at, 0);
+      return -1;
+    }
+
+  /* 
+   * the mac address is the key of the identity cache, it is asked for 
+   * first so its response is normally in before the job can start
+   */
+
+  set_cmd (&cmd, CMD_UDP_DISCOVER, 0, 0);
+  send (at->udp_fd, &cmd, sizeof (cmd), 0);
+
+  if (send (at->udp_fd, cmd_buf, cmd_len, 0) != cmd_len)
+    bjnp_debug (LOG_WARN, "start_attempt: send - %s\n", strerror (errno));
+  gettimeofday (&at->sent, NULL);
+  return 0;
+}
+
+static int
+read_attempt (struct job_attempt *at)
+{
+/*
+ * Read the responses to the job details and discover command of an attempt
+ * Returns: 0 = ok, -1 = error, errno is set
+ */
+
+  char resp_buf[BJNP_RESP_MAX];
+  struct BJNP_command *resp = (struct BJNP_command *) resp_buf;
+  ssize_t resp_len;
+
+  while ((resp_len = recv (at->udp_fd, resp_buf, sizeof (resp_buf), 0)) > 0)
+    {
+      if (resp_len < (ssize_t) sizeof (struct BJNP_command))
+	continue;
+
+      if ((resp->cmd_code == CMD_UDP_PRINT_JOB_DET) && (at->session < 0))
+	{
+	  bjnp_hexdump (LOG_DEBUG2, "Job details response:", resp_buf,
+			resp_len);
+	  at->session = ntohs (resp->session_id);
+	  if (at->tries == 1)
+	    ctl_rtt_sample (usec_since (&at->sent));
+	}
+      else if ((resp->cmd_code == CMD_UDP_DISCOVER)
+	       && (resp_len == sizeof (struct INIT_RESPONSE)))
+	{
+	  memcpy (at->mac, ((struct INIT_RESPONSE *) resp_buf)->mac_addr,
+		  sizeof (at->mac));
+	  at->have_mac = 1;
+	}
+    }
+
+  if ((resp_len < 0) && (errno != EAGAIN) && (errno != EINTR))
+    return -1;
+  return 0;
+}
+
+http_addrlist_t *
+bjnp_start_job (http_addrlist_t * list, char *user, char *title, int *fd)
+{
+/* 
+ * Send details of printjob to printer and connect to its print port.
+ * Both exchanges run at the same time. When the printer has more than one
+ * address, the next address is tried each BJNP_ATTEMPT_DELAY_USEC while 
+ * earlier attempts continue (happy eyeballs, RFC 8305). The first address
+ * that answers the job details and accepts the connection is used.
+ * Returns: addrlist set to address details of used printer, fd is set to
+ *          the print connection. NULL when no address responded, errno
+ *          is set
+ */
+
+  char cmd_buf[BJNP_CMD_MAX];
+  char hostname[256];
+  char addrname[INET6_ADDRSTRLEN];
+  int cmd_len;
+  struct JOB_DETAILS *job;
+  struct job_attempt at[BJNP_ATTEMPT_MAX];
+  int count = 0;
+  int active = 0;
+  int winner = -1;
+  int error = ETIMEDOUT;
+  int max_fd;
+  int i;
+  int err;
+  socklen_t err_len;
+  long wait;
+  fd_set rfds;
+  fd_set wfds;
+  struct timeval timeout;
+  struct timeval last_start;
+  http_addrlist_t *next = list;
+
+  /* keep details, the job may have to be resumed in a new session */
+
+  if (user != job_user)
+    snprintf (job_user, sizeof (job_user), "%s", user);
+  if (title != job_title)
+    snprintf (job_title, sizeof (job_title), "%s", title);
+
+  /* create job details command */
+
+  set_cmd ((struct BJNP_command *) cmd_buf, CMD_UDP_PRINT_JOB_DET, 0,
+	   sizeof (*job));
+
+  gethostname (hostname, 255);
+
+  job = (struct JOB_DETAILS *) (cmd_buf);
+  charTo2byte (job->unknown, "", sizeof (job->unknown));
+  charTo2byte (job->hostname, hostname, sizeof (job->hostname));
+  charTo2byte (job->username, user, sizeof (job->username));
+  charTo2byte (job->jobtitle, title, sizeof (job->jobtitle));
+  cmd_len = sizeof (struct BJNP_command) + sizeof (*job);
+
+  bjnp_hexdump (LOG_DEBUG2, "Job details", cmd_buf, cmd_len);
+
+  cur_printer_model[0] = '\0';
+  cur_printer_IEEE1284_id[0] = '\0';
+
+  for (;;)
+    {
+      /* start the next address when it is due or all others failed */
+
+      while ((next != NULL) && (count < BJNP_ATTEMPT_MAX) &&
+	     ((active == 0)
+	      || (usec_since (&last_start) >= BJNP_ATTEMPT_DELAY_USEC)))
+	{
+	  bjnp_debug (LOG_DEBUG, "Connecting to %s:%d\n",
+		      addr_string (&next->addr, addrname, sizeof (addrname)),
+		      ntohs (next->addr.ipv4.sin_port));
+	  if (start_attempt (&at[count], next, cmd_buf, cmd_len) == 0)
+	    {
+	      gettimeofday (&last_start, NULL);
+	      count++;
+	      active++;
+	    }
+	  else
+	    error = errno;
+	  next = next->next;
+	}
+
+      if ((active == 0) || (winner >= 0))
+	break;
+
+      /* wait for responses, connections, resends or the next address */
+
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      max_fd = -1;
+      wait = BJNP_RTO_MAX_USEC;
+      if ((next != NULL) && (count < BJNP_ATTEMPT_MAX))
+	wait = BJNP_ATTEMPT_DELAY_USEC - usec_since (&last_start);
+
+      for (i = 0; i < count; i++)
+	{
+	  if (at[i].udp_fd == -1)
+	    continue;
+
+	  FD_SET (at[i].udp_fd, &rfds);
+	  if (at[i].udp_fd > max_fd)
+	    max_fd = at[i].udp_fd;
+	  if (!at[i].connected)
+	    {
+	      FD_SET (at[i].tcp_fd, &wfds);
+	      if (at[i].tcp_fd > max_fd)
+		max_fd = at[i].tcp_fd;
+	    }
+	  if ((at[i].session < 0) &&
+	      (ctl_rto (at[i].tries) - usec_since (&at[i].sent) < wait))
+	    wait = ctl_rto (at[i].tries) - usec_since (&at[i].sent);
+	}
+      if (wait < 0)
+	wait = 0;
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_usec = wait % 1000000;
+
+      if (select (max_fd + 1, &rfds, &wfds, NULL, &timeout) < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  error = errno;
+	  break;
+	}
+
+      for (i = 0; (i < count) && (winner < 0); i++)
+	{
+	  if (at[i].udp_fd == -1)
+	    continue;
+
+	  if (FD_ISSET (at[i].udp_fd, &rfds) && (read_attempt (&at[i]) < 0))
+	    {
+	      error = errno;
+	      close_attempt (&at[i], 1);
+	      active--;
+	      continue;
+	    }
+
+	  if (!at[i].connected && FD_ISSET (at[i].tcp_fd, &wfds))
+	    {
+	      err_len = sizeof (err);
+	      if (getsockopt (at[i].tcp_fd, SOL_SOCKET, SO_ERROR, &err,
+			      &err_len) != 0)
+		err = errno;
+	      if (err != 0)
+		{
+		  bjnp_debug (LOG_INFO, "Connect failed: %s\n",
+			      strerror (err));
+		  error = err;
+		  close_attempt (&at[i], 1);
+		  active--;
+		  continue;
+		}
+	      at[i].connected = 1;
+	    }
+
+	  if ((at[i].session < 0) &&
+	      (usec_since (&at[i].sent) >= ctl_rto (at[i].tries)))
+	    {
+	      if (at[i].tries >= BJNP_SETUP_TRIES)
+		{
+		  error = ETIMEDOUT;
+		  close_attempt (&at[i], 0);
+		  active--;
+		  continue;
+		}
+	      send (at[i].udp_fd, cmd_buf, cmd_len, 0);
+	      gettimeofday (&at[i].sent, NULL);
+	      at[i].tries++;
+	    }
+
+	  if ((at[i].session >= 0) && at[i].connected)
+	    winner = i;
+	}
+    }
+
+  /* the other addresses are no longer needed */
+
+  for (i = 0; i < count; i++)
+    if (i != winner)
+      close_attempt (&at[i], 1);
+
+  if (winner < 0)
+    {
+      errno = error;
+      return NULL;
+    }
+
+  session_id = at[winner].session;
+  reset_job_state ();
+
+  /*
+   * The identity is only needed for side channel requests, it is taken 
+   * from the cache or looked up when asked for. A missing or old cache
+   * entry is refreshed after the job
+   */
+
+  job_addr = at[winner].addr->addr;
+  job_addr_valid = 1;
+  job_mac_valid = at[winner].have_mac;
+  memcpy (job_mac, at[winner].mac, sizeof (job_mac));
+  id_refresh = !job_mac_valid
+    || (id_cache_lookup (job_mac, cur_printer_model,
+			 cur_printer_IEEE1284_id) != 1);
+
+  fcntl (at[winner].tcp_fd, F_SETFL,
+	 fcntl (at[winner].tcp_fd, F_GETFL) & ~O_NONBLOCK);
+  *fd = at[winner].tcp_fd;
+  at[winner].tcp_fd = -1;
+
+  /* its UDP socket is the control socket for the rest of the session */
+
+  ctl_adopt (at[winner].udp_fd, &at[winner].addr->addr);
+  at[winner].udp_fd = -1;
+
+  bjnp_debug (LOG_DEBUG, "Session %d started after %d attempts\n",
+	      session_id, count);
+  return at[winner].addr;
+}
+
+void
+bjnp_finish_job (http_addrlist_t * list)
+{
+/* 
+ * Signal end of printjob to printer
+ */
+
+  char resp_buf[BJNP_RESP_MAX];
+  int resp_len;
+  struct BJNP_command cmd;
+
+  set_cmd (&cmd, CMD_UDP_CLOSE, session_id, 0 );
+
+  bjnp_hexdump (LOG_DEBUG2, "Finish printjob", (char *) &cmd,
+		sizeof (struct BJNP_command));
+  resp_len =
+    udp_command (&list->addr, (char *) &cmd, sizeof (struct BJNP_command),
+		 resp_buf, BJNP_RESP_MAX);
+
+  if (resp_len != sizeof (struct BJNP_command))
+    {
+      bjnp_debug (LOG_CRIT,
+		  "Received %d characters on close command, expected %d\n",
+		  resp_len, sizeof (struct BJNP_command));
+    }
+  bjnp_hexdump (LOG_DEBUG2, "Finish printjob response", resp_buf, resp_len);
+
+}
+
+http_addrlist_t *
+bjnp_resume_job (http_addrlist_t * list, int *fd)
+{
+/*
+ * Close the current print session and start a new one for the same job,
+ * e.g. after the connection to the printer was lost
+ * Returns: addrlist set to address details of used printer, fd is set to
+ *          the new print connection. NULL when no printer responded
+ */
+
+  bjnp_finish_job (list);
+  return bjnp_start_job (list, job_user, job_title, fd);
+}
+
+void
+bjnp_set_discover_rounds (int rounds)
+{
+/*
+ * set the nr of discover broadcasts sent by bjnp_discover_printers()
+ */
+
+  if (rounds < 1)
+    rounds = 1;
+  else if (rounds > BJNP_DISCOVER_ROUNDS_MAX)
+    rounds = BJNP_DISCOVER_ROUNDS_MAX;
+  discover_rounds = rounds;
+}
+
+void
+bjnp_set_discover_interfaces (const char *include, const char *exclude)
+{
+/*
+ * set the interfaces discovery uses (NULL = all) and the interfaces it
+ * does not use (NULL = none), both as comma separated shell patterns
+ */
+
+  discover_include = include;
+  discover_exclude = exclude;
+}
+
+void
+bjnp_set_window (int size)
+{
+/*
+ * set the max. number of print packets that may be waiting for an ack
+ */
+
+  if (size < 1)
+    size = 1;
+  else if (size > BJNP_WINDOW_MAX)
+    size = BJNP_WINDOW_MAX;
+  window_size = size;
+  cur_window = size;
+  bjnp_debug (LOG_INFO, "Print window set to %d packets\n", window_size);
+}
+
+int
+bjnp_get_window (void)
+{
+  return window_size;
+}
+
+int
+bjnp_acks_pending (void)
+{
+/*
+ * Returns: number of print packets sent for which no ack was received yet
+ */
+
+  return slots_used;
+}
+
+int
+bjnp_write_ready (void)
+{
+/*
+ * Returns: 1 when a new print packet may be sent, 0 otherwise
+ */
+
+  return (slots_used < cur_window) && !rejecting && !bjnp_throttle_wait ();
+}
+
+void
+bjnp_set_chunksize (int size)
+{
+/*
+ * set size of print packets, 0 selects automatic sizing:
+ * we start every job with BJNP_PRINTBUF_MAX and double the size while 
+ * the printer keeps accepting full packets. When the printer throttles 
+ * or acks a larger packet short, we return to the largest size that
+ * was accepted and stop probing for this job
+ */
+
+  if (size == 0)
+    {
+      chunk_auto = 1;
+      chunk_probing = 1;
+      size = BJNP_PRINTBUF_MAX;
+    }
+  else
+    {
+      chunk_auto = 0;
+      chunk_probing = 0;
+      if (size > BJNP_CHUNK_MAX)
+	size = BJNP_CHUNK_MAX;
+    }
+  chunk_size = size;
+  chunk_good = size;
+  chunk_probe_ok = 0;
+  bjnp_debug (LOG_INFO, "Print packet size set to %d%s\n", chunk_size,
+	      chunk_auto ? " (auto)" : "");
+}
+
+int
+bjnp_get_chunksize (void)
+{
+/*
+ * Returns: max. nr of print bytes to send in the next packet
+ */
+
+  return chunk_size;
+}
+
+int
+bjnp_get_chunksize_max (void)
+{
+/*
+ * Returns: max. nr of print bytes that will ever be sent in a packet
+ */
+
+  return chunk_auto ? BJNP_CHUNK_MAX : chunk_size;
+}
+
+static void
+chunk_accepted (ssize_t count)
+{
+/*
+ * printer accepted a packet of count bytes, try larger packets after 
+ * BJNP_CHUNK_PROBES full size packets were accepted
+ */
+
+  if (!chunk_probing || (count < chunk_size))
+    return;
+
+  if (count > chunk_good)
+    chunk_good = count;
+
+  if ((++chunk_probe_ok >= BJNP_CHUNK_PROBES) && (chunk_size < BJNP_CHUNK_MAX))
+    {
+      chunk_size *= 2;
+      chunk_probe_ok = 0;
+      bjnp_debug (LOG_INFO, "Probing print packet size %d\n", chunk_size);
+    }
+}
+
+static void
+chunk_rejected (void)
+{
+/*
+ * printer throttled or acked a packet short, fall back to largest 
+ * packet size that was accepted
+ */
+
+  if (!chunk_probing)
+    return;
+
+  chunk_size = chunk_good;
+  chunk_probing = 0;
+  bjnp_debug (LOG_INFO, "Print packet size fixed at %d\n", chunk_size);
+}
+
+static long
+usec_since (struct timeval *start)
+{
+/*
+ * Returns: nr of usec elapsed since start, negative if start is in the future
+ */
+
+  struct timeval now;
+
+  gettimeofday (&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000000L +
+    (now.tv_usec - start->tv_usec);
+}
+
+static void
+throttle_backoff (void)
+{
+/*
+ * Printer rejected data. The delay before we try again starts small and
+ * doubles while the printer keeps throttling. When the printer is busy
+ * but not printing (e.g. cleaning), its buffer will not drain soon, so 
+ * we allow a longer delay than when it is printing
+ */
+
+  long max_delay;
+
+  if (throttle_delay == 0)
+    throttle_delay = BJNP_THROTTLE_MIN_USEC;
+  else
+    throttle_delay *= 2;
+
+  if (printer_bst_valid && (printer_bst & BST_BUSY)
+      && !(printer_bst & BST_PRINTING))
+    max_delay = BJNP_THROTTLE_MAX_USEC;
+  else
+    max_delay = BJNP_THROTTLE_PRINTING_USEC;
+
+  if (throttle_delay > max_delay)
+    throttle_delay = max_delay;
+
+  gettimeofday (&throttle_until, NULL);
+  throttle_until.tv_usec += throttle_delay;
+  throttle_until.tv_sec += throttle_until.tv_usec / 1000000;
+  throttle_until.tv_usec %= 1000000;
+
+  if (!throttle_active)
+    {
+      gettimeofday (&throttle_start, NULL);
+      throttle_active = 1;
+    }
+  throttle_count++;
+
+  bjnp_debug (LOG_INFO, "Printer does not accept data, throttling for %ld ms\n",
+	      throttle_delay / 1000);
+}
+
+long
+bjnp_throttle_wait (void)
+{
+/*
+ * Returns: nr of usec to wait before print data may be sent again
+ */
+
+  long wait;
+
+  if (!timerisset (&throttle_until))
+    return 0;
+
+  if ((wait = -usec_since (&throttle_until)) <= 0)
+    {
+      timerclear (&throttle_until);
+      return 0;
+    }
+  return wait;
+}
+
+void
+bjnp_set_ack_timeout (int seconds)
+{
+/*
+ * set the max. time to wait for an ack from the printer, 0 = forever
+ */
+
+  ack_timeout = seconds * 1000000L;
+  bjnp_debug (LOG_INFO, "Ack timeout set to %d seconds\n", seconds);
+}
+
+long
+bjnp_ack_wait (void)
+{
+/*
+ * Returns: usec until the printer should have acked a packet, 0 when
+ *          this time has passed, -1 when no ack is expected
+ */
+  long wait;
+
+  if ((ack_timeout == 0) || (slots_used == 0))
+    return -1;
+
+  if ((wait = ack_timeout - usec_since (&ack_progress)) < 0)
+    wait = 0;
+  return wait;
+}
+
+void
+bjnp_reset_window (int fd)
+{
+/*
+ * Forget all packets waiting for an ack, the caller must send their data
+ * again. Acks that still arrive for them are ignored.
+ * fd is the new connection when the caller reconnected to the printer,
+ * -1 when the connection is kept
+ */
+  int i;
+
+  bjnp_debug (LOG_INFO, "Dropping %d packets waiting for an ack\n",
+	      slots_used);
+
+  for (i = 0; i < BJNP_WINDOW_MAX; i++)
+    io_slot[i].state = SLOT_FREE;
+  slot_head = 0;
+  slots_used = 0;
+  rejecting = 0;
+  rejected_retired = 0;
+  cur_window = 1;
+  window_reset = 1;
+
+  if (fd >= 0)
+    {
+      /* a response of the old connection will never be completed */
+
+      ack_len = 0;
+#ifdef HAVE_MSG_ZEROCOPY
+      if (zerocopy)
+	bjnp_enable_zerocopy (fd);
+#endif
+    }
+}
+
+void
+bjnp_get_throttle_stats (int *count, long *msec)
+{
+/*
+ * Returns the nr of times the printer throttled in this job and the 
+ * total time it took before print data was accepted again
+ */
+
+  *count = throttle_count;
+  *msec = throttle_msec;
+}
+
+void
+bjnp_count_syscalls (int count)
+{
+/*
+ * Account for system calls made outside of this module while printing
+ */
+
+  io_syscalls += count;
+}
+
+void
+bjnp_get_syscall_stats (unsigned long *syscalls, unsigned long *acked)
+{
+/*
+ * Returns the nr of system calls made for this job and the nr of
+ * bytes acked by the printer
+ */
+
+  *syscalls = io_syscalls;
+  *acked = io_acked;
+}
+
+static void
+send_status_query (void)
+{
+/*
+ * Send a status query on the control socket, the response is handled by
+ * bjnp_status_poll(). A resent query keeps its seq_no, so a late response
+ * to an earlier copy is used as well
+ */
+
+  if (status_tries == 0)
+    {
+      set_cmd (&status_cmd, CMD_UDP_GET_STATUS, 0, 0);
+      status_req = ctl_add (ntohs (status_cmd.seq_no), (char *) &status_resp,
+			    sizeof (status_resp));
+    }
+
+  bjnp_hexdump (LOG_DEBUG2, "Get printer status", (char *) &status_cmd,
+		sizeof (struct BJNP_command));
+
+  if (send (ctl_fd, &status_cmd, sizeof (status_cmd), 0)
+      != sizeof (status_cmd))
+    bjnp_debug (LOG_WARN, "send_status_query: %s\n", strerror (errno));
+
+  gettimeofday (&status_sent, NULL);
+  status_tries++;
+}
+
+int
+bjnp_status_open (http_addrlist_t * addrlist)
+{
+/*
+ * Get the control socket to query the printer status while printing.
+ * Queries are sent by bjnp_status_request() and responses are matched by
+ * sequence number, so the run loop never blocks on them.
+ * Returns: socket or -1 on error
+ */
+
+  status_drop ();
+  return ctl_open (&addrlist->addr);
+}
+
+void
+bjnp_status_close (void)
+{
+/*
+ * Stop querying the status, an outstanding query is dropped. The control
+ * socket stays open for the rest of the print session
+ */
+
+  status_drop ();
+}
+
+int
+bjnp_status_request (void)
+{
+/*
+ * Start a status query, unless one is outstanding already
+ * Returns: 0 = query sent or outstanding, -1 = no control socket
+ */
+
+  if (ctl_fd == -1)
+    return -1;
+
+  if (status_tries == 0)
+    send_status_query ();
+  return 0;
+}
+
+long
+bjnp_status_timeout (void)
+{
+/*
+ * Returns: usec until bjnp_status_poll() must be called to resend or 
+ *          abandon the query, -1 if no query is outstanding
+ */
+
+  long wait;
+
+  if (status_tries == 0)
+    return -1;
+
+  if ((wait = ctl_rto (status_tries) - usec_since (&status_sent)) < 0)
+    wait = 0;
+  return wait;
+}
+
+int
+bjnp_status_poll (bjnp_paper_status_t * paper)
+{
+/*
+ * Read responses on the control socket and resend the status query when
+ * it timed out. Call when the control socket is readable or 
+ * bjnp_status_timeout() expired.
+ * Returns: 1 = query finished, paper is set
+ *          0 = no response yet
+ *          -1 = printer did not respond, paper is set to BJNP_PAPER_UNKNOWN
+ */
+
+  int resp_len;
+  int id_len;
 
+  if ((ctl_fd != -1) && (ctl_receive () < 0))
+    bjnp_debug (LOG_DEBUG, "bjnp_status_poll: recv - %s\n", strerror (errno));
 
-	      /* printer found, get IP-address and hostname */
-	      get_printer_address (resp_buf,
-				   list[num_printers].ip_address,
-				   list[num_printers].hostname);
-	      list[num_printers].port = BJNP_PORT_PRINT;
-	      http_addr.ipv4.sin_family = AF_INET;
-	      http_addr.ipv4.sin_port = htons (BJNP_PORT_PRINT);
-	      http_addr.ipv4.sin_addr.s_addr =
-		inet_addr (list[num_printers].ip_address);
-	      memset (http_addr.ipv4.sin_zero, '\0',
-		      sizeof sendaddr.sin_zero);
+  if ((status_tries > 0) && (status_req >= 0)
+      && (ctl_req[status_req].resp_len >= 0))
+    {
+      resp_len = ctl_req[status_req].resp_len;
+      if (status_tries == 1)
+	ctl_rtt_sample (usec_since (&status_sent));
+      status_drop ();
 
+      bjnp_hexdump (LOG_DEBUG2, "Printer status:", (char *) &status_resp,
+		    resp_len);
 
-	      /* set printer make and model as well as IEEE1284 identity */
+      /* make sure the status string is terminated */
 
-	      get_printer_id (&http_addr, list[num_printers].model,
-			      list[num_printers].IEEE1284_id);
+      id_len = resp_len - (int) offsetof (struct IDENTITY, id);
+      if (id_len >= BJNP_IEEE1284_MAX)
+	id_len = BJNP_IEEE1284_MAX - 1;
+      if (id_len < 0)
+	id_len = 0;
+      status_resp.id[id_len] = '\0';
 
-	      num_printers++;
-	    }
-	}
-      active_fdset = fdset;
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+      *paper = parse_status_to_paperout (status_resp.id);
+      return 1;
     }
-  bjnp_debug (LOG_DEBUG, "printer discovery finished...\n");
 
-  for (i = 0; i < no_sockets; i++)
-    close (socket_fd[i]);
+  if ((status_tries > 0) && (bjnp_status_timeout () == 0))
+    {
+      if (status_tries < BJNP_STATUS_TRIES)
+	{
+	  send_status_query ();
+	  return 0;
+	}
 
-  return num_printers;
+      bjnp_debug (LOG_INFO, "Printer did not respond to status query\n");
+      status_drop ();
+      *paper = BJNP_PAPER_UNKNOWN;
+      return -1;
+    }
+  return 0;
 }
 
-
-http_addrlist_t *
-bjnp_send_job_details (http_addrlist_t * list, char *user, char *title)
+int
+bjnp_probe_printer (http_addrlist_t * addr, long usec)
 {
-/* 
- * send details of printjob to printer
- * Returns: addrlist set to address details of used printer
+/*
+ * Send a single status query and wait at most usec for the response.
+ * This is a cheap check if the printer can be reached.
+ * Returns: 1 when the printer is neither busy nor printing, 0 when it is,
+ *          -1 when the printer did not respond
  */
 
-  char cmd_buf[BJNP_CMD_MAX];
-  char resp_buf[BJNP_RESP_MAX];
-  char hostname[256];
-  int resp_len;
-  struct JOB_DETAILS *job;
-  struct BJNP_command *resp;
-
-  /* send job details command */
-
-  while (list != NULL)
-    {
-      /* we only support IPv4 for now */
-
-      if (list->addr.addr.sa_family != AF_INET) {
-	list = list->next;
-	continue;
-      }
-      set_cmd ((struct BJNP_command *) cmd_buf, CMD_UDP_PRINT_JOB_DET, 0,
-	       sizeof (*job));
-
-      /* create payload */
-
-      gethostname (hostname, 255);
+  bjnp_paper_status_t paper;
+  fd_set fdset;
+  struct timeval timeout;
+  long wait;
 
-      job = (struct JOB_DETAILS *) (cmd_buf);
-      charTo2byte (job->unknown, "", sizeof (job->unknown));
-      charTo2byte (job->hostname, hostname, sizeof (job->hostname));
-      charTo2byte (job->username, user, sizeof (job->username));
-      charTo2byte (job->jobtitle, title, sizeof (job->jobtitle));
+  if (ctl_open (&addr->addr) == -1)
+    return -1;
 
-      bjnp_hexdump (LOG_DEBUG2, "Job details", cmd_buf,
-		    (sizeof (struct BJNP_command) + sizeof (*job)));
+  printer_bst_valid = 0;
+  status_drop ();
+  send_status_query ();
 
-      bjnp_debug (LOG_DEBUG, "Connecting to %s:%d\n",
-		  inet_ntoa (list->addr.ipv4.sin_addr),
-		  ntohs (list->addr.ipv4.sin_port));
-      resp_len =
-	udp_command (&list->addr, cmd_buf,
-		     sizeof (struct BJNP_command) +
-		     sizeof (struct JOB_DETAILS), resp_buf, BJNP_RESP_MAX);
+  while ((wait = usec - usec_since (&status_sent)) > 0)
+    {
+      FD_ZERO (&fdset);
+      FD_SET (ctl_fd, &fdset);
+      timeout.tv_sec = wait / 1000000;
+      timeout.tv_usec = wait % 1000000;
 
-      if (resp_len > 0)
+      if (select (ctl_fd + 1, &fdset, NULL, NULL, &timeout) <= 0)
 	{
-	  bjnp_hexdump (LOG_DEBUG2, "Job details response:", resp_buf,
-			resp_len);
-	  resp = (struct BJNP_command *) resp_buf;
-	  session_id = ntohs (resp->session_id);
-	  io_slot.free = 1;
+	  if (errno == EINTR)
+	    continue;
+	  break;
+	}
 
-	  /* set printer information in case it is needed later */
+      if (bjnp_status_poll (&paper) == 1)
+	{
+	  /* a printer that does not report BST flags is taken as idle */
 
-	  get_printer_id (&(list->addr), cur_printer_model,
-			  cur_printer_IEEE1284_id);
-	  return list;
+	  return !printer_bst_valid
+	    || ((printer_bst & (BST_BUSY | BST_PRINTING)) == 0);
 	}
-      list = list->next;
     }
-  return list;			/* NULL */
+  status_drop ();
+  return -1;
 }
 
-void
-bjnp_finish_job (http_addrlist_t * list)
+int
+bjnp_enable_zerocopy (int fd)
 {
-/* 
- * Signal end of printjob to printer
+/*
+ * Send large print packets with MSG_ZEROCOPY on socket fd
+ * Returns: 0 if ok
+ *          -1 if not supported
  */
+#ifdef HAVE_MSG_ZEROCOPY
+  int one = 1;
 
-  char resp_buf[BJNP_RESP_MAX];
-  int resp_len;
-  struct BJNP_command cmd;
+  if (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof (one)) == 0)
+    {
+      zerocopy = 1;
+      zc_sent = 0;
+      zc_done = 0;
+      bjnp_debug (LOG_INFO, "Using MSG_ZEROCOPY for packets of %d bytes or more\n",
+		  BJNP_ZEROCOPY_MIN);
+      return 0;
+    }
+  bjnp_debug (LOG_WARN, "Can not enable MSG_ZEROCOPY: %s\n", strerror (errno));
+#else
+  bjnp_debug (LOG_WARN, "MSG_ZEROCOPY is not supported on this system\n");
+#endif
+  zerocopy = 0;
+  return -1;
+}
 
-  set_cmd (&cmd, CMD_UDP_CLOSE, session_id, 0 );
+#ifdef HAVE_MSG_ZEROCOPY
+static void
+reap_zerocopy (int fd)
+{
+/*
+ * Read MSG_ZEROCOPY completions from the socket error queue.
+ * The kernel numbers zerocopy sends from 0 and reports completed
+ * sends as ranges, in order
+ */
 
-  bjnp_hexdump (LOG_DEBUG2, "Finish printjob", (char *) &cmd,
-		sizeof (struct BJNP_command));
-  resp_len =
-    udp_command (&list->addr, (char *) &cmd, sizeof (struct BJNP_command),
-		 resp_buf, BJNP_RESP_MAX);
+  struct msghdr msg;
+  struct sock_extended_err *serr;
+  struct cmsghdr *cm;
+  char control[128];
 
-  if (resp_len != sizeof (struct BJNP_command))
+  while (zc_done != zc_sent)
     {
-      bjnp_debug (LOG_CRIT,
-		  "Received %d characters on close command, expected %d\n",
-		  resp_len, sizeof (struct BJNP_command));
-    }
-  bjnp_hexdump (LOG_DEBUG2, "Finish printjob response", resp_buf, resp_len);
+      memset (&msg, 0, sizeof (msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof (control);
+
+      io_syscalls++;
+      if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+	return;
+
+      for (cm = CMSG_FIRSTHDR (&msg); cm != NULL; cm = CMSG_NXTHDR (&msg, cm))
+	{
+	  serr = (struct sock_extended_err *) CMSG_DATA (cm);
+	  if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+	    continue;
 
+	  if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+	    bjnp_debug (LOG_DEBUG2, "MSG_ZEROCOPY: kernel copied data\n");
+	  zc_done = serr->ee_data + 1;
+	}
+    }
 }
+#endif
 
 ssize_t
 bjnp_write2 (int fd, const void *buf, size_t count)
@@ -796,32 +3095,73 @@ bjnp_write2 (int fd, const void *buf, size_t count)
 /*
  * This function writes printdata to the printer.  This function mimicks the std. 
  * lib. write function as much as possible.
+ * The command header and the print data are sent in a single call, the
+ * print data is not copied. buf must stay valid until the packet is acked.
  * Returns: number of bytes written to the printer
  */
+  struct iovec iov[2];
+  struct msghdr msg;
   int sent_bytes;
   int terrno;
+  int slot;
 
-  if (!io_slot.free)
+  if (!bjnp_write_ready ())
     {
       errno = EAGAIN;
       return -1;
     }
 
+  slot = (slot_head + slots_used) % BJNP_WINDOW_MAX;
+
   /* set BJNP command header */
 
-  io_slot.seq_no =
-    set_cmd ((struct BJNP_command *) io_slot.print_buf, CMD_TCP_PRINT,
-	     session_id, count);
-  io_slot.count = count;
-  memcpy (io_slot.print_buf + sizeof (struct BJNP_command), buf, count);
+  io_slot[slot].seq_no =
+    set_cmd (&io_slot[slot].cmd, CMD_TCP_PRINT, session_id, count);
+  io_slot[slot].count = count;
+  io_slot[slot].zerocopy = 0;
+
+  iov[0].iov_base = &io_slot[slot].cmd;
+  iov[0].iov_len = sizeof (struct BJNP_command);
+  iov[1].iov_base = (void *) buf;
+  iov[1].iov_len = count;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (count > 0) ? 2 : 1;
 
   bjnp_debug (LOG_DEBUG, "bjnp_write2: printing %d bytes\n", count);
-  bjnp_hexdump (LOG_DEBUG2, "Print data:", (char *) io_slot.print_buf,
-		sizeof (struct BJNP_command) + count);
+  bjnp_hexdump (LOG_DEBUG2, "Print command:", (char *) &io_slot[slot].cmd,
+		sizeof (struct BJNP_command));
+  bjnp_hexdump (LOG_DEBUG2, "Print data:", buf, count);
+
+  sent_bytes = -1;
+#ifdef HAVE_MSG_ZEROCOPY
+  if (zerocopy && (count >= BJNP_ZEROCOPY_MIN))
+    {
+      io_syscalls++;
+      if ((sent_bytes = sendmsg (fd, &msg, MSG_ZEROCOPY)) >= 0)
+	{
+	  io_slot[slot].zerocopy = 1;
+	  io_slot[slot].zc_id = zc_sent++;
+	}
+      else if (errno == ENOBUFS)
+	{
+	  /* out of pinned memory, this packet is sent the normal way */
+
+	  bjnp_debug (LOG_DEBUG, "bjnp_write2: MSG_ZEROCOPY failed, copying\n");
+	}
+      else
+	return sent_bytes;
+    }
+#endif
+
+  if (sent_bytes < 0)
+    {
+      io_syscalls++;
+      sent_bytes = sendmsg (fd, &msg, 0);
+    }
 
-  if ((sent_bytes =
-       write (fd, io_slot.print_buf,
-	      sizeof (struct BJNP_command) + count)) < 0)
+  if (sent_bytes < 0)
     {
       /* return result from write */
       terrno = errno;
@@ -832,100 +3172,158 @@ bjnp_write2 (int fd, const void *buf, size_t count)
   /* correct nr of bytes sent for length of command */
   /* sent_byte < expected is an unrecoverable error */
 
-  else if (sent_bytes != ((int) (sizeof (struct BJNP_command) + count)))
+  if (sent_bytes != ((int) (sizeof (struct BJNP_command) + count)))
     {
       errno = EIO;
       return -1;
     }
-  io_slot.free = 0;
+  io_slot[slot].state = SLOT_SENT;
+  if (slots_used++ == 0)
+    gettimeofday (&ack_progress, NULL);
+
+  if (throttle_active && (count > 0))
+    {
+      /* sending again after throttling, account the time lost */
+
+      throttle_msec += usec_since (&throttle_start) / 1000;
+      throttle_active = 0;
+    }
   return sent_bytes - sizeof (struct BJNP_command);
 }
 
-int
-bjnp_backchannel (int fd, ssize_t * written)
+static int
+retire_slots (ssize_t * written)
 {
 /*
- * This function receives the responses to the write commands.
- * written wil be set to the number of bytes confirmed by the printer
- * Returns: 
- * BJNP_OK when valid ack is received, written is set to number of bytes 
- *         sent to and accepted by printer (could be 0 for keep-alive)
- * BJNP_IO_ERROR when any io-error occurred
- * BJNP_NOT_AN_ACK when the packet received was not an ack, must be ignored
- * BJNP_THROTTLE when printer indicated it could not handle the input data
+ * retire acked slots in the order they were sent, so written only 
+ * reports bytes that follow the data acked before. A slot sent with 
+ * MSG_ZEROCOPY is only retired when the kernel is done with its data
+ * Returns: BJNP_OK, BJNP_THROTTLE or BJNP_IO_ERROR as bjnp_backchannel
  */
-  char resp_buf[BJNP_RESP_MAX];
-  struct PRINT_RESP *resp;
-  fd_set input;
-  struct timeval timeout;
-  unsigned int recv_bytes;
-  unsigned int resp_seqno;
-  int terrno;
-  int payload;
-
-  bjnp_debug (LOG_DEBUG, "bjnp_backchannel: receiving response\n");
-
-  /* get response header */
 
-  if ((recv_bytes =
-       read (fd, resp_buf,
-	     sizeof (struct BJNP_command))) != sizeof (struct BJNP_command))
-    {
-      terrno = errno;
-      bjnp_debug (LOG_CRIT,
-		  "bjnp_backchannel: (recv) could not read response header, recieved %d bytes!\n",
-		  recv_bytes);
-      bjnp_debug (LOG_CRIT, "bjnp_backchannel: (recv) error: %s!\n",
-		  strerror (terrno));
-      errno = terrno;
-      return BJNP_IO_ERROR;
-    }
-
-  /* got response header back, get payload length */
+  int throttled;
 
-  resp = (struct PRINT_RESP *) resp_buf;
-
-  payload = ntohl (resp->cmd.payload_len);
-
-  if (payload > 0)
+  *written = 0;
+  throttled = 0;
+  while ((slots_used > 0) && (io_slot[slot_head].state == SLOT_ACKED)
+	 && (!io_slot[slot_head].zerocopy
+	     || ((int32_t) (io_slot[slot_head].zc_id - zc_done) < 0)))
     {
-      /* read payload (nr of bytes received by printer */
+      if (io_slot[slot_head].acked != io_slot[slot_head].count)
+	{
+	  /* data was sent to printer, but printer reports that it is busy */
+	  /* report this only once for all packets that were in flight */
+	  /* a packet may be acked short, count what was accepted and */
+	  /* resend only the rest, without a delay as the printer made */
+	  /* progress */
 
-      FD_ZERO (&input);
-      FD_SET (fd, &input);
+	  if (rejected_retired && (io_slot[slot_head].acked > 0))
+	    {
+	      bjnp_debug (LOG_CRIT,
+			  "bjnp_backchannel: printer accepted packet %d after rejecting earlier data\n",
+			  io_slot[slot_head].seq_no);
+	      errno = EIO;
+	      return BJNP_IO_ERROR;
+	    }
+	  if (!rejected_retired)
+	    {
+	      *written += io_slot[slot_head].acked;
+	      if (io_slot[slot_head].acked == 0)
+		throttled = 1;
+	      else
+		bjnp_debug (LOG_INFO,
+			    "Printer accepted %ld of %ld bytes of packet %d, resending the rest\n",
+			    (long) io_slot[slot_head].acked,
+			    (long) io_slot[slot_head].count,
+			    io_slot[slot_head].seq_no);
+	    }
+	  rejected_retired = 1;
+	  chunk_rejected ();
 
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
+	  /* 
+	   * the printer buffer is full, so packets in flight would only 
+	   * be rejected as well. Fall back to one packet at a time
+	   */
 
-      if (select (fd + 1, &input, NULL, NULL, &timeout) <= 0)
+	  cur_window = 1;
+	}
+      else if (rejected_retired && (io_slot[slot_head].count > 0))
 	{
-	  terrno = errno;
+	  /* printer accepted data that follows data it rejected */
+
 	  bjnp_debug (LOG_CRIT,
-		      "bjnp_backchannel: could not read response payload (select)!\n");
-	  errno = terrno;
+		      "bjnp_backchannel: printer accepted packet %d after rejecting earlier data\n",
+		      io_slot[slot_head].seq_no);
+	  errno = EIO;
 	  return BJNP_IO_ERROR;
 	}
-
-      if ((recv_bytes =
-	   read (fd, resp_buf + sizeof (struct BJNP_command),
-		 ntohl (resp->cmd.payload_len))) !=
-	  ntohl (resp->cmd.payload_len))
+      else
 	{
-	  terrno = errno;
-	  bjnp_debug (LOG_CRIT,
-		      "bjnp_backchannel: could not read response payload (recv)!\n");
-	  errno = terrno;
-	  return BJNP_IO_ERROR;
+	  *written += io_slot[slot_head].count;
+	  chunk_accepted (io_slot[slot_head].count);
+
+	  /* progress, next throttle starts with a short delay again */
+
+	  if (io_slot[slot_head].count > 0)
+	    throttle_delay = 0;
+
+	  /* printer keeps up, grow window again */
+
+	  if ((io_slot[slot_head].count > 0) && (cur_window < window_size))
+	    cur_window++;
 	}
-      *written = ntohl (resp->num_printed);
+
+      io_slot[slot_head].state = SLOT_FREE;
+      slot_head = (slot_head + 1) % BJNP_WINDOW_MAX;
+      slots_used--;
     }
-  else
+
+  /* all outstanding packets are acked, caller will resend rejected data */
+
+  if (slots_used == 0)
     {
-      /* there is no payload, assume 0 bytes received */
-      *written = 0;
+      rejecting = 0;
+      rejected_retired = 0;
+    }
+
+  if (throttled)
+    {
+      /* add a delay before we try again */
+
+      throttle_backoff ();
+      return BJNP_THROTTLE;
     }
+  return BJNP_OK;
+}
+
+static int
+retire_acked (ssize_t * written)
+{
+/*
+ * Retire acked slots and account for the bytes acked by the printer
+ */
+  int result;
+
+  if ((result = retire_slots (written)) != BJNP_IO_ERROR)
+    io_acked += *written;
+  return result;
+}
+
+static int
+parse_ack (struct PRINT_RESP *resp)
+{
+/*
+ * Process one response frame from the printer, the ack is matched to
+ * the packet it belongs to
+ * Returns: BJNP_OK when the ack was recorded, BJNP_NOT_AN_ACK when the
+ *          frame must be ignored, BJNP_IO_ERROR on a protocol error
+ */
+  ssize_t acked;
+  unsigned int resp_seqno;
+  int slot;
+  int i;
 
-  bjnp_hexdump (LOG_DEBUG2, "TCP response:", resp_buf,
+  bjnp_hexdump (LOG_DEBUG2, "TCP response:", (char *) resp,
 		sizeof (struct BJNP_command) + ntohl (resp->cmd.payload_len));
 
   if (resp->cmd.cmd_code != CMD_TCP_PRINT)
@@ -936,14 +3334,39 @@ bjnp_backchannel (int fd, ssize_t * written)
       return BJNP_NOT_AN_ACK;
     }
 
+  /* without payload, assume 0 bytes received */
+
+  if (ntohl (resp->cmd.payload_len) >= sizeof (resp->num_printed))
+    acked = ntohl (resp->num_printed);
+  else
+    acked = 0;
+
   resp_seqno = ntohs (resp->cmd.seq_no);
 
+  /* find the outstanding packet this ack belongs to, acks may arrive out of order */
+
+  for (i = 0, slot = slot_head; i < slots_used; i++)
+    {
+      slot = (slot_head + i) % BJNP_WINDOW_MAX;
+      if ((io_slot[slot].state == SLOT_SENT)
+	  && (io_slot[slot].seq_no == resp_seqno))
+	break;
+    }
+
   /* do sanity check on sequence number of response */
-  if (resp_seqno != io_slot.seq_no)
+  if ((i == slots_used) && window_reset)
+    {
+      /* late ack for a packet that was dropped */
+
+      bjnp_debug (LOG_INFO, "Ignoring ack for dropped packet %d\n",
+		  resp_seqno);
+      return BJNP_NOT_AN_ACK;
+    }
+  if (i == slots_used)
     {
       bjnp_debug (LOG_CRIT,
 		  "bjnp_backchannel: printer reported sequence number %d, expected %d\n",
-		  resp_seqno, io_slot.seq_no);
+		  resp_seqno, io_slot[slot_head].seq_no);
 
       errno = EIO;
       return BJNP_IO_ERROR;
@@ -953,74 +3376,197 @@ bjnp_backchannel (int fd, ssize_t * written)
 
   bjnp_debug (LOG_DEBUG,
 	      "bjnp_backchannel: response: written = %lx, seqno = %lx\n",
-	      *written, resp_seqno);
+	      acked, resp_seqno);
+
+  /* check length reported by printer, a short ack is handled as progress */
+
+  if (acked > io_slot[slot].count)
+    {
+      /* printer reports unexpected number of bytes */
+      bjnp_debug (LOG_CRIT,
+		  "bjnp_backchannel: printer reported %d bytes received, expected %d\n",
+		  acked, io_slot[slot].count);
+      errno = EIO;
+      return BJNP_IO_ERROR;
+    }
+
+  io_slot[slot].acked = acked;
+  io_slot[slot].state = SLOT_ACKED;
+  gettimeofday (&ack_progress, NULL);
+  if (io_slot[slot].acked != io_slot[slot].count)
+    rejecting = 1;
+
+  return BJNP_OK;
+}
+
+int
+bjnp_backchannel (int fd, ssize_t * written)
+{
+/*
+ * This function receives the responses to the write commands.
+ * Responses are read into a buffer with a single recv, all complete 
+ * responses in it are processed and a partial response is kept for 
+ * the next call.
+ * written wil be set to the number of bytes confirmed by the printer
+ * Returns: 
+ * BJNP_OK when valid ack is received, written is set to number of bytes 
+ *         sent to and accepted by printer (could be 0 for keep-alive or an
+ *         ack that arrived ahead of the ack for an earlier packet). When
+ *         the printer accepted only part of a packet, the rest must be sent
+ *         again once bjnp_acks_pending() returns 0
+ * BJNP_IO_ERROR when any io-error occurred
+ * BJNP_NOT_AN_ACK when the packet received was not an ack, must be ignored
+ * BJNP_THROTTLE when printer indicated it could not handle the input data
+ *         written is set to the bytes accepted before the rejected packet.
+ *         All data from the rejected packet on must be sent again once
+ *         bjnp_acks_pending() returns 0
+ */
+  struct PRINT_RESP resp;
+  ssize_t recv_bytes;
+  size_t frame_len;
+  size_t pos;
+  int acks;
+  int result;
+  int terrno;
 
-  io_slot.free = 1;
+  bjnp_debug (LOG_DEBUG, "bjnp_backchannel: receiving response\n");
+
+#ifdef HAVE_MSG_ZEROCOPY
+  /* 
+   * zerocopy completions also make the socket readable, slots may 
+   * be waiting for them
+   */
 
-  /* check length reported by printer */
+  if (zerocopy)
+    reap_zerocopy (fd);
+#endif
 
-  if (io_slot.count == *written)
+  io_syscalls++;
+  if ((recv_bytes = recv (fd, ack_buf + ack_len, sizeof (ack_buf) - ack_len,
+			  MSG_DONTWAIT)) <= 0)
     {
-      /* printer reported expected number of bytes */
-      return BJNP_OK;
+      terrno = (recv_bytes == 0) ? ECONNRESET : errno;
+
+      /* nothing to read (e.g. a zerocopy completion woke us up) */
+
+      if ((recv_bytes < 0) && (errno == EAGAIN || errno == EINTR))
+	{
+	  if (zerocopy)
+	    return retire_acked (written);
+	  *written = 0;
+	  return BJNP_NOT_AN_ACK;
+	}
+
+      bjnp_debug (LOG_CRIT,
+		  "bjnp_backchannel: (recv) could not read response: %s!\n",
+		  strerror (terrno));
+      errno = terrno;
+      return BJNP_IO_ERROR;
     }
-  else if (*written == 0)
+  ack_len += recv_bytes;
+
+  /* process all complete responses */
+
+  for (pos = 0, acks = 0;
+       ack_len - pos >= sizeof (struct BJNP_command); pos += frame_len)
     {
-      /* data was sent to printer, but printer reports that it is busy */
-      /* add a delay before we try again */
+      memcpy (&resp, ack_buf + pos, sizeof (struct BJNP_command));
+      frame_len = sizeof (struct BJNP_command) + ntohl (resp.cmd.payload_len);
 
-      bjnp_debug (LOG_INFO, "Printer does not accept data, throttling....\n");
-      usleep (40000);
-      return BJNP_THROTTLE;
+      if (frame_len > sizeof (ack_buf))
+	{
+	  bjnp_debug (LOG_CRIT,
+		      "bjnp_backchannel: response of %ld bytes does not fit!\n",
+		      (long) frame_len);
+	  errno = EIO;
+	  return BJNP_IO_ERROR;
+	}
+
+      if (ack_len - pos < frame_len)
+	break;
+
+      /* only the ack count of the payload is used */
+
+      memcpy (&resp, ack_buf + pos,
+	      frame_len < sizeof (resp) ? frame_len : sizeof (resp));
+
+      if ((result = parse_ack (&resp)) == BJNP_IO_ERROR)
+	return BJNP_IO_ERROR;
+      if (result == BJNP_OK)
+	acks++;
+    }
+
+  /* keep a partial response for the next call */
+
+  ack_len -= pos;
+  if (ack_len > 0)
+    memmove (ack_buf, ack_buf + pos, ack_len);
+
+  if (acks == 0)
+    {
+      *written = 0;
+      return BJNP_NOT_AN_ACK;
     }
 
-  /* printer reports unexpected number of bytes */
-  bjnp_debug (LOG_CRIT,
-	      "bjnp_backchannel: printer reported %d bytes received, expected %d\n",
-	      written, io_slot.count);
-  errno = EIO;
-  return BJNP_IO_ERROR;
+  return retire_acked (written);
 }
 
 ssize_t
 bjnp_write (int fd, const void *buf, size_t count)
 {
-  /* This is a wrapper around bjnp_write2. It parses the input stream for BJL commands 
-   * and outputs these in a new/separate tcp packet. Each call prints at most buffer upto
-   * next command
-   * It is an ugly hack, I know....
+  /* This is a wrapper around bjnp_write2. The caller must end the data at the next
+   * BJL command, see bjnp_split_next(), so each command starts a new tcp packet.
    * This function van also be used to send keep-alive packets when count = 0 
    */
 
-  char start_cmd[] = { 0x1b, 0x5b, 0x4b, 0x2, 0x0, 0x0 };
-  int print_count;
   int result;
   int terrno;
 
-  /* TODO: allow scanning over buffer borders */
-
   bjnp_debug (LOG_DEBUG, "bjnp_write: starting printing of %d characters\n",
 	      count);
 
-  if ((print_count =
-       find_bin_string (buf, count, start_cmd, sizeof (start_cmd))) == -1)
-    {
-      /* no command found, print whole buffer */
-
-      print_count = count;
-    }
-  /* print content of buf upto command */
-
-  result = bjnp_write2 (fd, buf, print_count);
+  result = bjnp_write2 (fd, buf, count);
   terrno = errno;
   bjnp_debug (LOG_DEBUG,
-	      "bjnp_write: Printed %d bytes, last command sent: %d\n",
-	      result, io_slot.seq_no);
+	      "bjnp_write: Printed %d bytes, %d packets waiting for ack\n",
+	      result, slots_used);
   errno = terrno;
 
   return result;
 }
 
+void
+bjnp_refresh_printer_id (void)
+{
+/*
+ * Look up the identity of the printer of the current job when it was 
+ * not cached or the cached identity is too old. This costs a round trip,
+ * so it is done after the job or when the identity is asked for
+ */
+
+  struct BJNP_command cmd;
+  struct INIT_RESPONSE resp;
+
+  if (!id_refresh || !job_addr_valid)
+    return;
+
+  if (!job_mac_valid)
+    {
+      set_cmd (&cmd, CMD_UDP_DISCOVER, 0, 0);
+      if (udp_command (&job_addr, (char *) &cmd, sizeof (cmd),
+		       (char *) &resp, sizeof (resp)) == sizeof (resp))
+	{
+	  memcpy (job_mac, resp.mac_addr, sizeof (job_mac));
+	  job_mac_valid = 1;
+	}
+    }
+
+  get_printer_id (&job_addr, cur_printer_model, cur_printer_IEEE1284_id);
+  if (job_mac_valid)
+    id_cache_store (job_mac, cur_printer_model, cur_printer_IEEE1284_id);
+  id_refresh = 0;
+}
+
 int
 bjnp_backendGetDeviceID (char *device_id, int device_id_size,
 			 char *make_model, int make_model_size)
@@ -1030,6 +3576,11 @@ bjnp_backendGetDeviceID (char *device_id, int device_id_size,
  * Returns: 0 if ok
  *          -1 if not found
  */
+  /* the identity is looked up when it did not arrive with the job details */
+
+  if ((cur_printer_model[0] == '\0') && job_addr_valid)
+    bjnp_refresh_printer_id ();
+
   strncpy (device_id, cur_printer_IEEE1284_id, device_id_size);
   device_id[device_id_size] = '\0';
 
@@ -20,8 +20,9 @@
  *
  * Contents:
  *
- *   backendDrainOutput() - Removed, integrated in main loop         
- *   backendRunLoop()     - Read and write print and back-channel data.
+ *   backendDrainOutput()   - Removed, integrated in main loop         
+ *   backendRunLoop()       - Read and write print and back-channel data.
+ *   backendRunLoopBuffer() - Write print data from memory.
  */
 
 /*
@@ -34,33 +35,1234 @@
 #else
 #  include <sys/select.h>
 #endif /* __hpux */
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD_H
+#  include <pthread.h>
+#endif /* HAVE_PTHREAD_H */
+#include <signal.h>
+#ifdef USE_EPOLL
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/mman.h>
+#  include <poll.h>
+#endif /* USE_IO_URING */
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+#  include <sys/signalfd.h>
+#endif /* USE_EPOLL || USE_IO_URING */
 
 /*
- * 'backendRunLoop()' - Read and write print and back-channel data.
+ * Events the run loop waits for, see wait_events()
+ */
+
+#define EV_PRINT_DATA	0x01	/* print data (or reader wake-up) ready */
+#define EV_DEVICE_IN	0x02	/* data from printer (acks) ready */
+#define EV_DEVICE_OUT	0x04	/* printer connection accepts data */
+#define EV_SIDE_CHANNEL	0x08	/* side channel request ready */
+#define EV_KEEP_ALIVE	0x10	/* printer connection is idle */
+#define EV_TIMEOUT	0x20	/* timeout passed to wait_events() expired */
+#define EV_SIGNAL	0x40	/* SIGTERM received */
+#define EV_STATUS	0x80	/* printer status response ready */
+
+/*
+ * Event engines
+ */
+
+#define ENGINE_SELECT	0	/* select(), always available */
+#define ENGINE_EPOLL	1	/* epoll, timerfd and signalfd */
+#define ENGINE_IO_URING	2	/* io_uring polls */
+
+/*
+ * Local globals...
+ */
+
+static size_t readahead = 0;	/* Ring size for reader thread, 0 = none */
+static volatile sig_atomic_t cancelled = 0;	/* SIGTERM received? */
+static size_t replay = BJNP_REPLAY_DEFAULT;	/* Acked data kept to resume */
+static ssize_t checkpoint = 0;	/* Offset the last job can be resumed from */
+
+#if defined(USE_IO_URING)
+static int engine = ENGINE_IO_URING;	/* Event engine to use */
+#elif defined(USE_EPOLL)
+static int engine = ENGINE_EPOLL;	/* Event engine to use */
+#else
+static int engine = ENGINE_SELECT;	/* Event engine to use */
+#endif /* USE_IO_URING */
+
+/*
+ * Event engine state. The select() engine rebuilds its fd sets for every
+ * call and uses the select timeout as keep-alive timer. The epoll engine
+ * only updates the interest list when the wanted events change and uses
+ * a timerfd for keep-alives. The io_uring engine queues one-shot polls
+ * for the wanted events and submits them and waits for completions in
+ * a single system call. Both receive SIGTERM through a signalfd
+ */
+
+static struct
+{
+  int engine;			/* Engine used by this run loop */
+  int input_fd;			/* Print data (or reader wake-up) fd or -1 */
+  int device_fd;		/* Printer connection */
+  int status_fd;		/* Status query socket or -1 */
+  int nfds;			/* Maximum file descriptor value + 1 */
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+  int signal_fd;		/* SIGTERM, -1 when ignored */
+  sigset_t old_mask;		/* Signal mask to restore */
+  struct timespec last_activity;	/* Last time printer connection was used */
+#endif /* USE_EPOLL || USE_IO_URING */
+#ifdef USE_EPOLL
+  int epoll_fd;			/* epoll instance or -1 */
+  int timer_fd;			/* Keep-alive timer */
+  int input_mask;		/* Registered events for input_fd */
+  int device_mask;		/* Registered events for device_fd */
+  int side_mask;		/* Registered events for CUPS_SC_FD */
+  int status_mask;		/* Registered events for status_fd */
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+  int ring_fd;			/* io_uring instance or -1 */
+  void *sq_ring;		/* Submission queue ring */
+  size_t sq_ring_size;		/* Size of sq_ring mapping */
+  unsigned *sq_head,		/* Submission queue head (kernel) */
+   *sq_tail,			/* Submission queue tail (us) */
+   *sq_mask,			/* Submission queue index mask */
+   *sq_array;			/* Submission queue index array */
+  unsigned sq_entries;		/* Submission queue size */
+  struct io_uring_sqe *sqes;	/* Submission queue entries */
+  size_t sqes_size;		/* Size of sqes mapping */
+  void *cq_ring;		/* Completion queue ring */
+  size_t cq_ring_size;		/* Size of cq_ring mapping */
+  unsigned *cq_head,		/* Completion queue head (us) */
+   *cq_tail,			/* Completion queue tail (kernel) */
+   *cq_mask;			/* Completion queue index mask */
+  struct io_uring_cqe *cqes;	/* Completion queue entries */
+  int armed;			/* Events with a poll in flight */
+#endif /* USE_IO_URING */
+} events;
+
+#ifdef HAVE_PTHREAD_H
+
+/*
+ * Reader thread state. The reader thread fills the ring buffer from
+ * print_fd while the run loop sends data from it, so the filter is not
+ * blocked while we wait for the printer. Only the reader advances
+ * read_pos and only the run loop advances ack_pos, so the ring needs
+ * no locks. The pipes are only written when the other side waits.
+ */
+
+static struct
+{
+  int print_fd;			/* Print file descriptor */
+  char *buffer;			/* Ring buffer */
+  size_t buffer_size;		/* Size of ring buffer */
+  ssize_t read_pos;		/* Stream offset of next byte to read */
+  ssize_t ack_pos;		/* Stream offset of first unacked byte */
+  int eof;			/* 1 = end of file, -1 = read error */
+  int read_errno;		/* errno of read error */
+  int loop_waiting;		/* Run loop waits for data? */
+  int reader_waiting;		/* Reader waits for free space? */
+  int data_pipe[2];		/* Reader -> run loop wake-up */
+  int space_pipe[2];		/* Run loop -> reader wake-up */
+  int running;			/* Reader thread started? */
+  pthread_t thread;		/* Reader thread */
+} reader;
+
+
+/*
+ * 'reader_thread()' - Copy print data from print_fd to the ring buffer.
+ */
+
+static void *
+reader_thread (void *arg)
+{
+  ssize_t read_pos,		/* Stream offset of next byte to read */
+    ack_pos,			/* Stream offset of first unacked byte */
+    bytes;			/* Bytes read */
+  size_t count;			/* Bytes to read */
+  char c;			/* Wake-up byte */
+
+  (void) arg;
+
+  for (read_pos = 0;;)
+    {
+      ack_pos = __atomic_load_n (&reader.ack_pos, __ATOMIC_SEQ_CST);
+
+      if (read_pos - ack_pos >= (ssize_t) reader.buffer_size)
+	{
+	  /*
+	   * Ring is full, wait until the run loop frees space. Check again
+	   * after announcing that we wait, so a wake-up can not be lost
+	   */
+
+	  __atomic_store_n (&reader.reader_waiting, 1, __ATOMIC_SEQ_CST);
+	  ack_pos = __atomic_load_n (&reader.ack_pos, __ATOMIC_SEQ_CST);
+	  if ((read_pos - ack_pos >= (ssize_t) reader.buffer_size)
+	      && (read (reader.space_pipe[0], &c, 1) < 0) && (errno != EINTR))
+	    break;
+	  __atomic_store_n (&reader.reader_waiting, 0, __ATOMIC_SEQ_CST);
+	  continue;
+	}
+
+      count = reader.buffer_size - (read_pos - ack_pos);
+      if (count > reader.buffer_size - (read_pos % reader.buffer_size))
+	count = reader.buffer_size - (read_pos % reader.buffer_size);
+
+      if ((bytes = read (reader.print_fd,
+			 reader.buffer + (read_pos % reader.buffer_size),
+			 count)) < 0)
+	{
+	  if (errno == EAGAIN || errno == EINTR)
+	    continue;
+
+	  reader.read_errno = errno;
+	  __atomic_store_n (&reader.eof, -1, __ATOMIC_SEQ_CST);
+	  break;
+	}
+      else if (bytes == 0)
+	{
+	  __atomic_store_n (&reader.eof, 1, __ATOMIC_SEQ_CST);
+	  break;
+	}
+
+      read_pos += bytes;
+      __atomic_store_n (&reader.read_pos, read_pos, __ATOMIC_SEQ_CST);
+
+      if (__atomic_exchange_n (&reader.loop_waiting, 0, __ATOMIC_SEQ_CST))
+	write (reader.data_pipe[1], "", 1);
+    }
+
+  /*
+   * Always wake up the run loop for end of file or errors
+   */
+
+  write (reader.data_pipe[1], "", 1);
+  return (NULL);
+}
+
+
+/*
+ * 'start_reader()' - Start the reader thread.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+start_reader (int print_fd,		/* I - Print file descriptor */
+	      char *buffer,		/* I - Ring buffer */
+	      size_t buffer_size)	/* I - Size of ring buffer */
+{
+  sigset_t mask,			/* Signals blocked in reader thread */
+    old_mask;				/* Signal mask of run loop */
+  int result;				/* Result of pthread_create */
+
+  memset (&reader, 0, sizeof (reader));
+  reader.print_fd = print_fd;
+  reader.buffer = buffer;
+  reader.buffer_size = buffer_size;
+
+  if (pipe (reader.data_pipe) < 0)
+    return (-1);
+
+  if (pipe (reader.space_pipe) < 0)
+    {
+      close (reader.data_pipe[0]);
+      close (reader.data_pipe[1]);
+      return (-1);
+    }
+
+  fcntl (reader.data_pipe[0], F_SETFL, O_NONBLOCK);
+
+  /*
+   * Signals are handled by the run loop, so block them in the reader
+   */
+
+  sigfillset (&mask);
+  pthread_sigmask (SIG_SETMASK, &mask, &old_mask);
+  result = pthread_create (&reader.thread, NULL, reader_thread, NULL);
+  pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+
+  if (result != 0)
+    {
+      close (reader.data_pipe[0]);
+      close (reader.data_pipe[1]);
+      close (reader.space_pipe[0]);
+      close (reader.space_pipe[1]);
+      return (-1);
+    }
+
+  reader.running = 1;
+  return (0);
+}
+
+
+/*
+ * 'stop_reader()' - Stop the reader thread and close its pipes.
+ */
+
+static void
+stop_reader (void)
+{
+  if (!reader.running)
+    return;
+
+  pthread_cancel (reader.thread);
+  pthread_join (reader.thread, NULL);
+  close (reader.data_pipe[0]);
+  close (reader.data_pipe[1]);
+  close (reader.space_pipe[0]);
+  close (reader.space_pipe[1]);
+  reader.running = 0;
+}
+#endif /* HAVE_PTHREAD_H */
+
+
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+
+/*
+ * 'open_signals()' - Receive SIGTERM through a signalfd.
+ *
+ * SIGTERM is left alone when it is ignored.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+open_signals (void)
+{
+  struct sigaction action;		/* Current SIGTERM action */
+  sigset_t mask;			/* Signals handled by the signalfd */
+
+  sigaction (SIGTERM, NULL, &action);
+  if (action.sa_handler == SIG_IGN)
+    return (0);
+
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGTERM);
+  sigprocmask (SIG_BLOCK, &mask, &events.old_mask);
+
+  if ((events.signal_fd = signalfd (-1, &mask, SFD_NONBLOCK)) < 0)
+    {
+      sigprocmask (SIG_SETMASK, &events.old_mask, NULL);
+      return (-1);
+    }
+
+  return (0);
+}
+
+
+/*
+ * 'close_signals()' - Restore normal SIGTERM handling.
+ */
+
+static void
+close_signals (void)
+{
+  if (events.signal_fd < 0)
+    return;
+
+  close (events.signal_fd);
+  sigprocmask (SIG_SETMASK, &events.old_mask, NULL);
+  events.signal_fd = -1;
+}
+
+
+/*
+ * 'idle_time()' - Time since the printer connection was last used.
+ */
+
+static long				/* O - Idle time in usec */
+idle_time (struct timespec *now)	/* O - Current time */
+{
+  clock_gettime (CLOCK_MONOTONIC, now);
+  return ((now->tv_sec - events.last_activity.tv_sec) * 1000000L +
+	  (now->tv_nsec - events.last_activity.tv_nsec) / 1000);
+}
+#endif /* USE_EPOLL || USE_IO_URING */
+
+#ifdef USE_EPOLL
+
+/*
+ * 'set_interest()' - Update the epoll interest list for a file descriptor.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+set_interest (int fd,			/* I - File descriptor */
+	      int *registered,		/* IO - Registered epoll events */
+	      int wanted)		/* I - Wanted epoll events, 0 = none */
+{
+  struct epoll_event ev;		/* Event to register */
+  int op;				/* epoll_ctl operation */
+
+  if (wanted == *registered)
+    return (0);
+
+  /*
+   * Unwanted fds are removed instead of registered without events, as
+   * epoll would still report hangups for them
+   */
+
+  if (wanted == 0)
+    op = EPOLL_CTL_DEL;
+  else if (*registered == 0)
+    op = EPOLL_CTL_ADD;
+  else
+    op = EPOLL_CTL_MOD;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = wanted;
+  ev.data.fd = fd;
+  bjnp_count_syscalls (1);
+  if (epoll_ctl (events.epoll_fd, op, fd, &ev) < 0)
+    return (-1);
+
+  *registered = wanted;
+  return (0);
+}
+
+
+/*
+ * 'arm_keep_alive()' - Start the keep-alive timer.
+ */
+
+static void
+arm_keep_alive (long usec)		/* I - Time until expiry */
+{
+  struct itimerspec timer;		/* Timer setting */
+
+  memset (&timer, 0, sizeof (timer));
+  timer.it_value.tv_sec = usec / 1000000;
+  timer.it_value.tv_nsec = (usec % 1000000) * 1000;
+  if (usec <= 0)
+    timer.it_value.tv_nsec = 1;
+  bjnp_count_syscalls (1);
+  timerfd_settime (events.timer_fd, 0, &timer, NULL);
+}
+
+
+/*
+ * 'keep_alive_expired()' - Check whether the printer connection is idle.
+ *
+ * The timer is not re-armed for every packet sent. When it expires, we
+ * check the time of the last activity and re-arm it for the remainder.
+ */
+
+static int				/* O - 1 when idle for KEEP_ALIVE_SECONDS */
+keep_alive_expired (void)
+{
+  struct timespec now;			/* Current time */
+  uint64_t expirations;			/* Nr of timer expirations */
+  long idle;				/* usec since last activity */
+
+  bjnp_count_syscalls (1);
+  if (read (events.timer_fd, &expirations, sizeof (expirations)) < 0)
+    return (0);
+
+  if ((idle = idle_time (&now)) < KEEP_ALIVE_SECONDS * 1000000L)
+    {
+      arm_keep_alive (KEEP_ALIVE_SECONDS * 1000000L - idle);
+      return (0);
+    }
+
+  events.last_activity = now;
+  arm_keep_alive (KEEP_ALIVE_SECONDS * 1000000L);
+  return (1);
+}
+
+
+/*
+ * 'open_epoll()' - Set up the epoll engine.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+open_epoll (void)
+{
+  struct epoll_event ev;		/* Event to register */
+
+  events.input_mask = 0;
+  events.device_mask = 0;
+  events.side_mask = 0;
+  events.status_mask = 0;
+  events.timer_fd = -1;
+
+  if ((events.epoll_fd = epoll_create (4)) < 0)
+    return (-1);
+
+  if ((events.timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0)
+    return (-1);
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = events.timer_fd;
+  if (epoll_ctl (events.epoll_fd, EPOLL_CTL_ADD, events.timer_fd, &ev) < 0)
+    return (-1);
+
+  arm_keep_alive (KEEP_ALIVE_SECONDS * 1000000L);
+
+  if (open_signals () < 0)
+    return (-1);
+
+  ev.data.fd = events.signal_fd;
+  if ((events.signal_fd >= 0)
+      && (epoll_ctl (events.epoll_fd, EPOLL_CTL_ADD, events.signal_fd, &ev)
+	  < 0))
+    return (-1);
+
+  return (0);
+}
+
+
+/*
+ * 'close_epoll()' - Release the epoll engine.
+ */
+
+static void
+close_epoll (void)
+{
+  if (events.timer_fd >= 0)
+    close (events.timer_fd);
+  events.timer_fd = -1;
+
+  if (events.epoll_fd >= 0)
+    close (events.epoll_fd);
+  events.epoll_fd = -1;
+}
+
+
+/*
+ * 'wait_epoll()' - Wait for events with epoll.
+ */
+
+static int				/* O - Ready events or -1 on error */
+wait_epoll (int wanted,			/* I - Wanted events */
+	    long timeout_usec)		/* I - Timeout or -1 for none */
+{
+  struct epoll_event ev[7];		/* Events reported by epoll */
+  struct signalfd_siginfo info;		/* Signal received */
+  int ready;				/* Ready events */
+  int result;				/* Nr of events */
+  int i;				/* Looping var */
+
+  /*
+   * Update the interest list, the printer connection is always 
+   * checked for acks
+   */
+
+  if ((set_interest (events.input_fd, &events.input_mask,
+		     (wanted & EV_PRINT_DATA) ? EPOLLIN : 0) < 0)
+      || (set_interest (events.device_fd, &events.device_mask,
+			EPOLLIN | ((wanted & EV_DEVICE_OUT) ? EPOLLOUT : 0))
+	  < 0)
+      || (set_interest (CUPS_SC_FD, &events.side_mask,
+			(wanted & EV_SIDE_CHANNEL) ? EPOLLIN : 0) < 0)
+      || ((events.status_fd >= 0)
+	  && (set_interest (events.status_fd, &events.status_mask,
+			    (wanted & EV_STATUS) ? EPOLLIN : 0) < 0)))
+    return (-1);
+
+  if ((result = epoll_wait (events.epoll_fd, ev, 7,
+			    timeout_usec < 0 ? -1 :
+			    (int) ((timeout_usec + 999) / 1000))) < 0)
+    return (-1);
+
+  if (result == 0)
+    return (EV_TIMEOUT);
+
+  for (ready = 0, i = 0; i < result; i++)
+    {
+      if (ev[i].data.fd == events.timer_fd)
+	{
+	  if (keep_alive_expired ())
+	    ready |= EV_KEEP_ALIVE;
+	}
+      else if (ev[i].data.fd == events.signal_fd)
+	{
+	  if (read (events.signal_fd, &info, sizeof (info)) > 0)
+	    ready |= EV_SIGNAL;
+	}
+      else if (ev[i].data.fd == events.device_fd)
+	{
+	  if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+	    ready |= EV_DEVICE_IN;
+	  if (ev[i].events & EPOLLOUT)
+	    ready |= EV_DEVICE_OUT;
+	}
+      else if (ev[i].data.fd == events.input_fd)
+	ready |= EV_PRINT_DATA;
+      else if (ev[i].data.fd == CUPS_SC_FD)
+	ready |= EV_SIDE_CHANNEL;
+      else if (ev[i].data.fd == events.status_fd)
+	ready |= EV_STATUS;
+    }
+
+  return (ready);
+}
+#endif /* USE_EPOLL */
+
+#ifdef USE_IO_URING
+
+/*
+ * 'open_uring()' - Set up the io_uring engine.
+ *
+ * liburing is not used, the rings are mapped here and accessed with
+ * atomic loads and stores as documented in io_uring(7).
+ */
+
+static int				/* O - 0 on success, -1 on error */
+open_uring (void)
+{
+  struct io_uring_params params;	/* Ring parameters */
+  char *sq_ring,			/* Submission queue ring */
+   *cq_ring;				/* Completion queue ring */
+
+  events.sq_ring = NULL;
+  events.cq_ring = NULL;
+  events.sqes = NULL;
+  events.armed = 0;
+
+  memset (&params, 0, sizeof (params));
+  if ((events.ring_fd = syscall (__NR_io_uring_setup, 8, &params)) < 0)
+    return (-1);
+
+  /*
+   * We need the timeout argument of io_uring_enter (linux 5.11)
+   */
+
+  if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+      errno = ENOSYS;
+      return (-1);
+    }
+
+  events.sq_ring_size = params.sq_off.array +
+    params.sq_entries * sizeof (unsigned);
+  events.cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof (struct io_uring_cqe);
+  events.sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  if ((events.sq_ring = mmap (NULL, events.sq_ring_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED,
+			      events.ring_fd, IORING_OFF_SQ_RING))
+      == MAP_FAILED)
+    {
+      events.sq_ring = NULL;
+      return (-1);
+    }
+
+  if ((events.cq_ring = mmap (NULL, events.cq_ring_size,
+			      PROT_READ | PROT_WRITE, MAP_SHARED,
+			      events.ring_fd, IORING_OFF_CQ_RING))
+      == MAP_FAILED)
+    {
+      events.cq_ring = NULL;
+      return (-1);
+    }
+
+  if ((events.sqes = mmap (NULL, events.sqes_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, events.ring_fd, IORING_OFF_SQES))
+      == MAP_FAILED)
+    {
+      events.sqes = NULL;
+      return (-1);
+    }
+
+  sq_ring = events.sq_ring;
+  events.sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+  events.sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+  events.sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+  events.sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+  events.sq_entries = params.sq_entries;
+
+  cq_ring = events.cq_ring;
+  events.cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+  events.cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+  events.cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+  events.cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+  return (open_signals ());
+}
+
+
+/*
+ * 'close_uring()' - Release the io_uring engine.
+ */
+
+static void
+close_uring (void)
+{
+  if (events.sqes)
+    munmap (events.sqes, events.sqes_size);
+  if (events.cq_ring)
+    munmap (events.cq_ring, events.cq_ring_size);
+  if (events.sq_ring)
+    munmap (events.sq_ring, events.sq_ring_size);
+  events.sqes = NULL;
+  events.cq_ring = NULL;
+  events.sq_ring = NULL;
+
+  if (events.ring_fd >= 0)
+    close (events.ring_fd);
+  events.ring_fd = -1;
+}
+
+
+/*
+ * 'arm_poll()' - Queue a one-shot poll for an event.
+ *
+ * The poll is only submitted with the next io_uring_enter. Its
+ * completion reports the event, after which it must be armed again.
+ */
+
+static void
+arm_poll (int fd,			/* I - File descriptor */
+	  int event,			/* I - Event to report */
+	  unsigned mask)		/* I - poll events */
+{
+  struct io_uring_sqe *sqe;		/* Submission queue entry */
+  unsigned tail,			/* Submission queue tail */
+    index;				/* Index of entry */
+
+  tail = *events.sq_tail;
+  if (tail - __atomic_load_n (events.sq_head, __ATOMIC_ACQUIRE)
+      >= events.sq_entries)
+    return;
+
+  index = tail & *events.sq_mask;
+  sqe = &events.sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  mask = (mask << 16) | (mask >> 16);
+#endif
+  sqe->poll32_events = mask;
+  sqe->user_data = event;
+  events.sq_array[index] = index;
+
+  __atomic_store_n (events.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  events.armed |= event;
+}
+
+
+/*
+ * 'wait_uring()' - Wait for events with io_uring.
+ *
+ * Only events that are not armed yet need a new poll, so normally one
+ * system call submits the polls and waits for the next completions.
+ * Keep-alives are timed from the last activity on the printer connection.
+ */
+
+static int				/* O - Ready events or -1 on error */
+wait_uring (int wanted,			/* I - Wanted events */
+	    long timeout_usec)		/* I - Timeout or -1 for none */
+{
+  struct io_uring_getevents_arg arg;	/* Wait arguments */
+  struct __kernel_timespec ts;		/* Wait timeout */
+  struct io_uring_cqe *cqe;		/* Completion queue entry */
+  struct signalfd_siginfo info;		/* Signal received */
+  struct timespec start,		/* Time we started waiting */
+    now;				/* Current time */
+  unsigned head,			/* Completion queue head */
+    tail,				/* Completion queue tail */
+    to_submit;				/* Nr of polls to submit */
+  long wait,				/* usec to wait */
+    idle;				/* usec since last activity */
+  int ready;				/* Ready events */
+
+  /*
+   * Arm polls for wanted events, the printer connection is always
+   * checked for acks
+   */
+
+  if ((wanted & EV_PRINT_DATA) && !(events.armed & EV_PRINT_DATA))
+    arm_poll (events.input_fd, EV_PRINT_DATA, POLLIN);
+  if (!(events.armed & EV_DEVICE_IN))
+    arm_poll (events.device_fd, EV_DEVICE_IN, POLLIN);
+  if ((wanted & EV_DEVICE_OUT) && !(events.armed & EV_DEVICE_OUT))
+    arm_poll (events.device_fd, EV_DEVICE_OUT, POLLOUT);
+  if ((wanted & EV_SIDE_CHANNEL) && !(events.armed & EV_SIDE_CHANNEL))
+    arm_poll (CUPS_SC_FD, EV_SIDE_CHANNEL, POLLIN);
+  if ((wanted & EV_STATUS) && !(events.armed & EV_STATUS))
+    arm_poll (events.status_fd, EV_STATUS, POLLIN);
+  if ((events.signal_fd >= 0) && !(events.armed & EV_SIGNAL))
+    arm_poll (events.signal_fd, EV_SIGNAL, POLLIN);
+
+  /*
+   * Wait until the keep-alive is due, or the timeout if that is earlier
+   */
+
+  idle = idle_time (&start);
+  if ((wait = KEEP_ALIVE_SECONDS * 1000000L - idle) < 0)
+    wait = 0;
+  if ((timeout_usec >= 0) && (timeout_usec < wait))
+    wait = timeout_usec;
+
+  ts.tv_sec = wait / 1000000;
+  ts.tv_nsec = (wait % 1000000) * 1000;
+  memset (&arg, 0, sizeof (arg));
+  arg.ts = (unsigned long) &ts;
+
+  to_submit = *events.sq_tail - __atomic_load_n (events.sq_head,
+						  __ATOMIC_ACQUIRE);
+  if ((syscall (__NR_io_uring_enter, events.ring_fd, to_submit, 1,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+		sizeof (arg)) < 0) && (errno != ETIME))
+    return (-1);
+
+  /*
+   * Reap completions, a poll that completed is no longer armed. Errors
+   * are reported as the event, so the run loop sees them on its next
+   * read or write
+   */
+
+  ready = 0;
+  head = *events.cq_head;
+  tail = __atomic_load_n (events.cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++)
+    {
+      cqe = &events.cqes[head & *events.cq_mask];
+      events.armed &= ~((int) cqe->user_data);
+      ready |= (int) cqe->user_data;
+    }
+  __atomic_store_n (events.cq_head, head, __ATOMIC_RELEASE);
+
+  if ((ready & EV_SIGNAL)
+      && (read (events.signal_fd, &info, sizeof (info)) <= 0))
+    ready &= ~EV_SIGNAL;
+
+  /*
+   * Polls may have been armed for events that are no longer wanted
+   */
+
+  ready &= wanted | EV_DEVICE_IN | EV_SIGNAL;
+
+  if ((idle = idle_time (&now)) >= KEEP_ALIVE_SECONDS * 1000000L)
+    {
+      events.last_activity = now;
+      ready |= EV_KEEP_ALIVE;
+    }
+
+  if ((timeout_usec >= 0)
+      && ((now.tv_sec - start.tv_sec) * 1000000L +
+	  (now.tv_nsec - start.tv_nsec) / 1000 >= timeout_usec))
+    ready |= EV_TIMEOUT;
+
+  return (ready);
+}
+#endif /* USE_IO_URING */
+
+
+/*
+ * 'wait_select()' - Wait for events with select.
+ */
+
+static int				/* O - Ready events or -1 on error */
+wait_select (int wanted,		/* I - Wanted events */
+	     long timeout_usec)		/* I - Timeout or -1 for none */
+{
+  fd_set input,				/* Input set for reading */
+    output;				/* Output set for writing */
+  struct timeval timeout;		/* Timeout for select */
+  int result;				/* Result code from select */
+  int ready;				/* Ready events */
+
+  FD_ZERO (&input);
+  FD_ZERO (&output);
+
+  if (wanted & EV_PRINT_DATA)
+    FD_SET (events.input_fd, &input);
+  FD_SET (events.device_fd, &input);
+  if (wanted & EV_SIDE_CHANNEL)
+    FD_SET (CUPS_SC_FD, &input);
+  if (wanted & EV_STATUS)
+    FD_SET (events.status_fd, &input);
+  if (wanted & EV_DEVICE_OUT)
+    FD_SET (events.device_fd, &output);
+
+  /*
+   * Without a timeout, the select timeout is the keep-alive timer
+   */
+
+  if (timeout_usec >= 0)
+    {
+      timeout.tv_sec = timeout_usec / 1000000;
+      timeout.tv_usec = timeout_usec % 1000000;
+    }
+  else
+    {
+      timeout.tv_sec = KEEP_ALIVE_SECONDS;
+      timeout.tv_usec = 0;
+    }
+
+  if ((result = select (events.nfds, &input, &output, NULL, &timeout)) < 0)
+    return (-1);
+
+  if (result == 0)
+    return (timeout_usec >= 0 ? EV_TIMEOUT : EV_KEEP_ALIVE);
+
+  ready = 0;
+  if ((wanted & EV_PRINT_DATA) && FD_ISSET (events.input_fd, &input))
+    ready |= EV_PRINT_DATA;
+  if (FD_ISSET (events.device_fd, &input))
+    ready |= EV_DEVICE_IN;
+  if ((wanted & EV_SIDE_CHANNEL) && FD_ISSET (CUPS_SC_FD, &input))
+    ready |= EV_SIDE_CHANNEL;
+  if ((wanted & EV_STATUS) && FD_ISSET (events.status_fd, &input))
+    ready |= EV_STATUS;
+  if (FD_ISSET (events.device_fd, &output))
+    ready |= EV_DEVICE_OUT;
+
+  return (ready);
+}
+
+
+/*
+ * 'close_events()' - Release the event engine resources.
+ */
+
+static void
+close_events (void)
+{
+#ifdef USE_EPOLL
+  if (events.engine == ENGINE_EPOLL)
+    close_epoll ();
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+  if (events.engine == ENGINE_IO_URING)
+    close_uring ();
+#endif /* USE_IO_URING */
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+  close_signals ();
+#endif /* USE_EPOLL || USE_IO_URING */
+  events.engine = ENGINE_SELECT;
+}
+
+
+/*
+ * 'open_events()' - Prepare the event engine for the run loop.
+ *
+ * When the selected engine can not be set up (e.g. io_uring is disabled
+ * in the kernel), we fall back to select().
+ */
+
+static void
+open_events (int input_fd,		/* I - Print data fd or -1 */
+	     int device_fd,		/* I - Printer connection */
+	     int status_fd)		/* I - Status query socket or -1 */
+{
+  int result;				/* Result of engine setup */
+
+  events.input_fd = input_fd;
+  events.device_fd = device_fd;
+  events.status_fd = status_fd;
+  events.nfds = (input_fd > device_fd ? input_fd : device_fd) + 1;
+  if (CUPS_SC_FD >= events.nfds)
+    events.nfds = CUPS_SC_FD + 1;
+  if (status_fd >= events.nfds)
+    events.nfds = status_fd + 1;
+
+  events.engine = engine;
+  result = 0;
+
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+  events.signal_fd = -1;
+  clock_gettime (CLOCK_MONOTONIC, &events.last_activity);
+#endif /* USE_EPOLL || USE_IO_URING */
+#ifdef USE_EPOLL
+  if (events.engine == ENGINE_EPOLL)
+    result = open_epoll ();
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+  if (events.engine == ENGINE_IO_URING)
+    result = open_uring ();
+#endif /* USE_IO_URING */
+
+  if (result < 0)
+    {
+      bjnp_debug (LOG_WARN, "Event engine %d not available (%s), using select\n",
+		  events.engine, strerror (errno));
+      close_events ();
+    }
+
+  bjnp_debug (LOG_DEBUG, "bjnp_runloop: using event engine %d\n",
+	      events.engine);
+}
+
+
+/*
+ * 'device_activity()' - Note that data was exchanged with the printer.
+ */
+
+static void
+device_activity (void)
+{
+#if defined(USE_EPOLL) || defined(USE_IO_URING)
+  if (events.engine != ENGINE_SELECT)
+    clock_gettime (CLOCK_MONOTONIC, &events.last_activity);
+#endif /* USE_EPOLL || USE_IO_URING */
+}
+
+
+/*
+ * 'wait_events()' - Wait for one of the wanted events.
+ *
+ * EV_KEEP_ALIVE is returned when the printer connection was idle for 
+ * KEEP_ALIVE_SECONDS, EV_TIMEOUT when the given timeout expired.
+ */
+
+static int				/* O - Ready events or -1 on error */
+wait_events (int wanted,		/* I - Wanted events */
+	     long timeout_usec)		/* I - Timeout or -1 for none */
+{
+  bjnp_count_syscalls (1);
+
+  switch (events.engine)
+    {
+#ifdef USE_EPOLL
+    case ENGINE_EPOLL:
+      return (wait_epoll (wanted, timeout_usec));
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+    case ENGINE_IO_URING:
+      return (wait_uring (wanted, timeout_usec));
+#endif /* USE_IO_URING */
+    default:
+      return (wait_select (wanted, timeout_usec));
+    }
+}
+
+
+/*
+ * 'end_run_loop()' - Release the print buffer, reader thread, events and
+ *                    status socket.
+ */
+
+static void
+end_run_loop (char *print_buffer)	/* I - Allocated ring buffer or NULL */
+{
+#ifdef HAVE_PTHREAD_H
+  stop_reader ();
+#endif /* HAVE_PTHREAD_H */
+  close_events ();
+  bjnp_status_close ();
+  free (print_buffer);
+}
+
+
+/*
+ * 'backendCancelled()' - Tell whether the last job was cancelled.
  */
 
-ssize_t				/* O - Total bytes on success, -1 on error */
-bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
-		     int device_fd,	/* I - Device file descriptor */
-		     http_addrlist_t * addrlist)
-					/* I - addresslist for printer */
+int				/* O - 1 if cancelled, 0 otherwise */
+bjnp_backendCancelled (void)
+{
+  return (cancelled);
+}
+
+
+/*
+ * 'backendSetReplay()' - Set the nr of acked bytes kept to resume a job.
+ */
+
+void
+bjnp_backendSetReplay (size_t size)	/* I - Max. nr of bytes kept */
+{
+  replay = size;
+}
+
+
+/*
+ * 'backendGetCheckpoint()' - Get the offset the last job can resume from.
+ *
+ * This is the offset of the last BJL command that the printer acked all
+ * data before, the start of the print data when there is none.
+ */
+
+ssize_t				/* O - Offset in print data */
+bjnp_backendGetCheckpoint (void)
+{
+  return (checkpoint);
+}
+
+
+/*
+ * 'backendSetReadahead()' - Read print data in a separate thread.
+ */
+
+void
+bjnp_backendSetReadahead (size_t size)	/* I - Size of ring buffer, 0 = off */
+{
+#ifdef HAVE_PTHREAD_H
+  readahead = size;
+#else
+  if (size > 0)
+    bjnp_debug (LOG_WARN, "Reader thread not supported, ignoring readahead\n");
+#endif /* HAVE_PTHREAD_H */
+}
+
+/*
+ * 'backendSetEngine()' - Select the event engine of the run loop.
+ */
+
+int				/* O - 0 on success, -1 if not available */
+bjnp_backendSetEngine (const char *name)	/* I - select, epoll or io_uring */
+{
+  if (!strcasecmp (name, "select"))
+    engine = ENGINE_SELECT;
+#ifdef USE_EPOLL
+  else if (!strcasecmp (name, "epoll"))
+    engine = ENGINE_EPOLL;
+#endif /* USE_EPOLL */
+#ifdef USE_IO_URING
+  else if (!strcasecmp (name, "io_uring"))
+    engine = ENGINE_IO_URING;
+#endif /* USE_IO_URING */
+  else
+    {
+      bjnp_debug (LOG_WARN, "Event engine %s not supported, ignored\n", name);
+      return (-1);
+    }
+
+  return (0);
+}
+
+/*
+ * 'cancel_job()' - Note that the job was cancelled (SIGTERM handler).
+ */
+
+static void
+cancel_job (int sig)			/* I - Signal number */
+{
+  (void) sig;
+
+  cancelled = 1;
+}
+
+
+/*
+ * 'reconnect()' - Open a new connection to the printer.
+ *
+ * The new connection gets the number of device_fd, so the caller keeps
+ * using it. Packets waiting for an ack on the old connection are dropped.
+ */
+
+static int				/* O - 0 on success, -1 on error */
+reconnect (int new_session,		/* I - Start a new print session? */
+	   int input_fd,		/* I - Print data fd or -1 */
+	   int device_fd,		/* I - Printer connection */
+	   int status_fd,		/* I - Status query socket or -1 */
+	   http_addrlist_t * addrlist)	/* I - addresslist for printer */
+{
+  int fd;				/* New printer connection */
+  http_addrlist_t *addr;	/* Address connected to */
+
+  fputs ("STATE: +connecting-to-device\n", stderr);
+
+  if (new_session)
+    addr = bjnp_resume_job (addrlist, &fd);
+  else
+    addr = httpAddrConnect (addrlist, &fd);
+
+  if (addr == NULL)
+    {
+      fprintf (stderr, "DEBUG: Unable to reconnect: %s\n", strerror (errno));
+      fputs ("STATE: -connecting-to-device\n", stderr);
+      return (-1);
+    }
+
+  /*
+   * The engine may still watch the old connection, so it is set up again
+   */
+
+  close_events ();
+  dup2 (fd, device_fd);
+  close (fd);
+  bjnp_reset_window (device_fd);
+  open_events (input_fd, device_fd, status_fd);
+
+  fputs ("STATE: -connecting-to-device\n", stderr);
+  return (0);
+}
+
+
+/*
+ * 'recover_stall()' - Prepare to resend print data the printer did not ack.
+ *
+ * When the printer still answers status queries, the data is sent again
+ * on the same connection, otherwise the connection is reopened first.
+ */
+
+static void
+recover_stall (int alive,		/* I - Printer answered status query? */
+	       int input_fd,		/* I - Print data fd or -1 */
+	       int device_fd,		/* I - Printer connection */
+	       int status_fd,		/* I - Status query socket or -1 */
+	       http_addrlist_t * addrlist)	/* I - addresslist for printer */
+{
+  if (alive)
+    {
+      fputs ("DEBUG: Printer responds, resending unacknowledged data\n",
+	     stderr);
+      bjnp_reset_window (-1);
+      return;
+    }
+
+  _cupsLangPuts (stderr,
+		 _("INFO: Printer not responding, reconnecting...\n"));
+
+  if (reconnect (0, input_fd, device_fd, status_fd, addrlist) < 0)
+    bjnp_reset_window (-1);
+}
+
+
+/*
+ * 'run_loop()' - Write print data from print_fd or memory to the printer.
+ */
+
+static ssize_t			/* O - Total bytes on success, -1 on error */
+run_loop (int print_fd,		/* I - Print file descriptor or -1 */
+	  const char *print_data,	/* I - Print data or NULL */
+	  size_t print_size,	/* I - Size of print data */
+	  int device_fd,	/* I - Device file descriptor */
+	  http_addrlist_t * addrlist)	/* I - addresslist for printer */
 {
   int send_keep_alive;		/* flag that an empty data packet should be sent to printer */
-  int nfds;			/* Maximum file descriptor value + 1 */
-  fd_set input,			/* Input set for reading */
-    output;			/* Output set for writing */
-  ssize_t print_bytes,		/* Print bytes read */
-    total_bytes,		/* Total bytes written */
+  int wanted,			/* Events to wait for */
+    ready;			/* Events that occurred */
+  int input_fd;			/* Print data fd or reader thread pipe */
+  int status_fd;		/* Status query socket */
+  int stalled;			/* 1 = checking printer after ack timeout, */
+				/* 2 = waiting for ack of resent data */
+  int alive;			/* Printer answered status query (1), */
+				/* did not answer (-1) or unknown (0) */
+  ssize_t read_pos,		/* Stream offset of next byte to read */
+    send_pos,			/* Stream offset of next byte to send */
+    total_bytes,		/* Total bytes written (and acked) */
     bytes;			/* Bytes written */
-  int result;			/* result code from select */
-  int paperout,			/* "Paper out" status */
-    ack_pending;		/* io slot status */
+  size_t buffer_size,		/* Size of print data buffer */
+    count;			/* Bytes to read or send */
+  int result;			/* result code from backchannel */
+  int paperout;			/* "Paper out" status */
   int offline;			/* "Off-line" status */
   int draining;			/* Drain command recieved? */
-  char print_buffer[BJNP_PRINTBUF_MAX],
-    /* Print data buffer */
-   *print_ptr;			/* Pointer into print data buffer */
-  struct timeval timeout;
+  int eof;			/* End of print data reached? */
+  long throttle_wait;		/* usec before we may send data again */
+  long status_wait;		/* usec before status query times out */
+  long ack_wait;		/* usec before printer must have acked */
+  ssize_t boundary;		/* Offset of last BJL command acked */
+  ssize_t ring_start;		/* Offset of oldest data kept in buffer */
+  ssize_t cmd_sent[BJNP_WINDOW_MAX];	/* Offsets of BJL commands sent, */
+				/* but not acked */
+  int cmd_first,		/* First entry in cmd_sent */
+    cmd_count;			/* Nr of entries in cmd_sent */
+  int lost;			/* Connection to printer lost? */
+  int resumes;			/* Nr of times job was resumed */
+  long wait_usec;		/* usec to wait for events, -1 = no limit */
+  bjnp_paper_status_t paper;	/* paper status from status query */
+  bjnp_splitter_t splitter;	/* search state for BJL commands */
+  ssize_t send_limit;		/* Stream offset upto which we may send */
+#ifdef HAVE_PTHREAD_H
+  char wakeup[64];		/* Wake-up bytes from reader thread */
+#endif /* HAVE_PTHREAD_H */
+  char *print_buffer;		/* Print data ring buffer */
+  char *owned_buffer;		/* Ring buffer allocated here */
 #if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
   struct sigaction action;	/* Actions for POSIX signals */
 #endif /* HAVE_SIGACTION && !HAVE_SIGSET */
@@ -75,89 +1277,256 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 #endif /* cups >= 1.3 */
 
   fprintf (stderr,
-	   "DEBUG: bjnp_backendRunLoop(print_fd=%d, device_fd=%d\n",
-	   print_fd, device_fd);
+	   "DEBUG: bjnp_backendRunLoop(print_fd=%d, device_fd=%d, "
+	   "print_size=%ld)\n", print_fd, device_fd, (long) print_size);
 
   /*
-   * If we are printing data from a print driver on stdin, ignore SIGTERM
-   * so that the driver can finish out any page data, e.g. to eject the
-   * current page.  We only do this for stdin printing as otherwise there
-   * is no way to cancel a raw print job...
+   * When the job is cancelled, we stop sending after the current packet
+   * and close the print session, also when printing data from a print
+   * driver on stdin. The printer ejects the current page itself...
    */
 
-  if (!print_fd)
-    {
+  cancelled = 0;
+
 #ifdef HAVE_SIGSET		/* Use System V signals over POSIX to avoid bugs */
-      sigset (SIGTERM, SIG_IGN);
+  sigset (SIGTERM, cancel_job);
 #elif defined(HAVE_SIGACTION)
-      memset (&action, 0, sizeof (action));
+  memset (&action, 0, sizeof (action));
 
-      sigemptyset (&action.sa_mask);
-      action.sa_handler = SIG_IGN;
-      sigaction (SIGTERM, &action, NULL);
+  sigemptyset (&action.sa_mask);
+  action.sa_handler = cancel_job;
+  sigaction (SIGTERM, &action, NULL);
 #else
-      signal (SIGTERM, SIG_IGN);
+  signal (SIGTERM, cancel_job);
 #endif /* HAVE_SIGSET */
+
+  if (print_data)
+    {
+      /*
+       * All print data is in memory already (a mapped file), so we send
+       * straight from it. The memory is used as a ring that never wraps
+       */
+
+      print_buffer = (char *) print_data;
+      owned_buffer = NULL;
+      buffer_size = print_size;
+      read_pos = print_size;
+      eof = 1;
+    }
+  else
+    {
+      /*
+       * Allocate a print buffer that can hold all packets waiting for an
+       * ack plus the next chunk read from print_fd. The buffer is used as a
+       * ring, print data is addressed by its offset in the print stream and
+       * stays in the buffer until the printer has acked it
+       */
+
+      buffer_size = (bjnp_get_window () + 1) * bjnp_get_chunksize_max ();
+      if (readahead > buffer_size)
+	buffer_size = readahead;
+
+      /*
+       * Acked data is kept back to the last BJL command, upto replay bytes,
+       * so the job can be resumed when the connection is lost
+       */
+
+      buffer_size += replay;
+      if ((owned_buffer = malloc (buffer_size)) == NULL)
+	{
+	  perror ("ERROR: Unable to allocate print buffer");
+	  return (-1);
+	}
+      print_buffer = owned_buffer;
+      read_pos = 0;
+      eof = 0;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  /*
+   * With readahead, a reader thread fills the buffer and we wait for its
+   * wake-ups instead of print_fd
+   */
+
+  if (readahead && !print_data
+      && (start_reader (print_fd, print_buffer, buffer_size) < 0))
+    {
+      perror ("ERROR: Unable to start reader thread");
+      free (owned_buffer);
+      return (-1);
     }
 
+#endif /* HAVE_PTHREAD_H */
+
   /*
-   * Figure out the maximum file descriptor value to use with select()...
+   * Set up the event engine, print data is announced by the reader
+   * thread when we have one. Printer status is queried on a separate
+   * socket, so we keep handling acks while we wait for the response...
    */
 
-  nfds = (print_fd > device_fd ? print_fd : device_fd) + 1;
+  status_fd = bjnp_status_open (addrlist);
+
+#ifdef HAVE_PTHREAD_H
+  if (reader.running)
+    input_fd = reader.data_pipe[0];
+  else
+#endif /* HAVE_PTHREAD_H */
+    input_fd = print_fd;
+  open_events (input_fd, device_fd, status_fd);
+
+  bjnp_split_reset (&splitter, 0);
 
   /*
    * Now loop until we are out of data from print_fd...
    */
 
-  for (print_bytes = 0, print_ptr = print_buffer, offline = -1,
-       paperout = -1, total_bytes = 0, ack_pending = 0, draining =
-       0, send_keep_alive = 0;;)
+  checkpoint = 0;
+  boundary = 0;
+  ring_start = 0;
+  cmd_first = 0;
+  cmd_count = 0;
+  lost = 0;
+  resumes = 0;
+
+  for (send_pos = 0, offline = -1, paperout = -1, stalled = 0,
+       total_bytes = 0, draining = 0, send_keep_alive = 0;;)
     {
       /*
-       * Use select() to determine whether we have data to copy around...
+       * When the connection to the printer was lost, start a new print
+       * session and resume from the last BJL command the printer acked
+       */
+
+      if (lost)
+	{
+	  if ((resumes == BJNP_RESUME_MAX)
+	      || (!print_data && (boundary < ring_start))
+	      || (reconnect (1, input_fd, device_fd, status_fd, addrlist) < 0))
+	    {
+	      end_run_loop (owned_buffer);
+	      return (-1);
+	    }
+
+	  fprintf (stderr, "DEBUG: Resuming job at offset %ld\n",
+		   (long) boundary);
+	  resumes++;
+	  lost = 0;
+	  total_bytes = boundary;
+	  send_pos = boundary;
+	  bjnp_split_reset (&splitter, send_pos);
+	  cmd_count = 0;
+	}
+
+      /*
+       * We are done when all print data is read and acked by the printer
        */
 
-      FD_ZERO (&input);
-      FD_ZERO (&output);
+      if (eof && (total_bytes == read_pos))
+	{
+#if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR >= 3)
+	  if (draining)
+	    {
+	      command = CUPS_SC_CMD_DRAIN_OUTPUT;
+	      status = CUPS_SC_STATUS_OK;
+	      datalen = 0;
+	      cupsSideChannelWrite (command, status, data, datalen, 1.0);
+	      draining = 0;
+	    }
+#endif
+	  break;
+	}
 
       /*
-       * Accept new printdata only when no data is left 
+       * Wait for events to determine whether we have data to copy around...
        */
 
-      if (!print_bytes)
-	FD_SET (print_fd, &input);
+      wanted = 0;
 
       /*
-       * accept backchannel data from printer, used for acks 
+       * Accept new printdata while there is room left in the buffer
        */
 
-      FD_SET (device_fd, &input);
+#ifdef HAVE_PTHREAD_H
+      if (reader.running)
+	{
+	  /*
+	   * Announce that we wait for data, then pick up what the reader
+	   * thread read so far
+	   */
+
+	  __atomic_store_n (&reader.loop_waiting, 1, __ATOMIC_SEQ_CST);
+	  read_pos = __atomic_load_n (&reader.read_pos, __ATOMIC_SEQ_CST);
+	  if (!eof)
+	    wanted |= EV_PRINT_DATA;
+	}
+      else
+#endif /* HAVE_PTHREAD_H */
+      if (!eof && (read_pos - ring_start < (ssize_t) buffer_size))
+	wanted |= EV_PRINT_DATA;
 
+      /*
+       * backchannel data from printer (acks) is always accepted 
+       */
 
       /*
-       * Accept side channel data, unless there is print data pending (cups >= 1.3)
+       * Accept side channel data, unless we are draining (cups >= 1.3)
+       * As the buffer is refilled while packets are in flight, print data
+       * is nearly always pending, so we can not wait for an empty buffer
        */
 
 #if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR >= 3)
-      if (!print_bytes && !draining)
-	FD_SET (CUPS_SC_FD, &input);
+      if (!draining)
+	wanted |= EV_SIDE_CHANNEL;
 #endif
 
       /*
        * Check if printer is ready to receive data when we have something to send 
-       * (printdata is left or keep-alive is to be sent) but no ack is pending
+       * (printdata is left or keep-alive is to be sent) and the window
+       * of packets waiting for an ack is not full
        */
 
-      if ((send_keep_alive || print_bytes) && !ack_pending)
-	FD_SET (device_fd, &output);
+      send_limit = bjnp_split_next (&splitter, print_buffer, buffer_size,
+				    send_pos, read_pos, eof);
 
-      timeout.tv_sec = KEEP_ALIVE_SECONDS;
-      timeout.tv_usec = 0;
+      if ((send_keep_alive || (send_pos < send_limit)) && bjnp_write_ready ())
+	wanted |= EV_DEVICE_OUT;
+
+      /*
+       * When the printer throttled us, wake up when we may send again.
+       * Wait for the response to a status query, or until it must be resent
+       */
+
+      wait_usec = -1;
+      if ((send_pos < send_limit)
+	  && ((throttle_wait = bjnp_throttle_wait ()) > 0))
+	wait_usec = throttle_wait;
 
-      result = select (nfds, &input, &output, NULL, &timeout);
+      if ((status_wait = bjnp_status_timeout ()) >= 0)
+	{
+	  wanted |= EV_STATUS;
+	  if ((wait_usec < 0) || (status_wait < wait_usec))
+	    wait_usec = status_wait;
+	}
+
+      /*
+       * Wake up when the printer should have acked print data, unless we
+       * are checking the printer already
+       */
+
+      if ((stalled != 1) && ((ack_wait = bjnp_ack_wait ()) >= 0)
+	  && ((wait_usec < 0) || (ack_wait < wait_usec)))
+	wait_usec = ack_wait;
+
+      ready = wait_events (wanted, wait_usec);
+
+      if (cancelled || ((ready > 0) && (ready & EV_SIGNAL)))
+	{
+	  fputs ("DEBUG: Received SIGTERM, closing print session\n", stderr);
+	  cancelled = 1;
+	  end_run_loop (owned_buffer);
+	  return (-1);
+	}
 
-      if (result < 0)
+      if (ready < 0)
 	{
 	  /*
 	   * Pause printing to clear any pending errors...
@@ -174,28 +1543,78 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 	    {
 	      fputs ("DEBUG: Received an interrupt before any bytes were "
 		     "written, aborting!\n", stderr);
+	      end_run_loop (owned_buffer);
 	      return (0);
 	    }
 
 	  sleep (1);
 	  continue;
 	}
-      if (result == 0)
+      if (ready & EV_KEEP_ALIVE)
 	{
 	  /*
 	   * timeout - no data for printer; make sure that next time we
 	   * send a keep-alive packet to avoid that  connection to printer  
 	   * times out
 	   */
-	  if (!ack_pending)
+	  if (!bjnp_acks_pending ())
 	    send_keep_alive = 1;
 
 	  bjnp_debug (LOG_DEBUG,
-		      "bjnp_runloop: select timeout send_keep_alive=%d print_fd=%d "
-		      "device_fd=%d print_bytes=%d ack_pending=%d\n",
-		      send_keep_alive, print_fd, device_fd, print_bytes,
-		      ack_pending);
-	  continue;
+		      "bjnp_runloop: keep-alive timeout send_keep_alive=%d print_fd=%d "
+		      "device_fd=%d unsent=%d acks_pending=%d\n",
+		      send_keep_alive, print_fd, device_fd,
+		      (int) (read_pos - send_pos), bjnp_acks_pending ());
+	}
+
+      /*
+       * When the printer did not ack print data in time, check whether it
+       * still responds before we send the data again
+       */
+
+      alive = 0;
+      if ((stalled != 1) && (bjnp_ack_wait () == 0))
+	{
+	  if (!stalled)
+	    {
+	      fputs ("STATE: +timed-out-warning\n", stderr);
+	      _cupsLangPuts (stderr,
+			     _("WARNING: Printer does not acknowledge print "
+			       "data, checking printer...\n"));
+	    }
+	  stalled = 1;
+
+	  /* without a status socket, we have to wait for the response here */
+
+	  if (bjnp_status_request () < 0)
+	    alive = (bjnp_get_paper_status (addrlist) != BJNP_PAPER_UNKNOWN)
+	      ? 1 : -1;
+	}
+
+      /*
+       * Check for a status response, this resends the query when it
+       * timed out
+       */
+
+      if (((ready & EV_STATUS) || (bjnp_status_timeout () == 0))
+	  && ((result = bjnp_status_poll (&paper)) != 0))
+	{
+	  if ((paper == BJNP_PAPER_OUT) && (paperout != 1))
+	    {
+	      fputs ("STATE: +media-empty-error\n", stderr);
+	      _cupsLangPuts (stderr, _("ERROR: Out of paper!\n"));
+	      paperout = 1;
+	    }
+	  alive = result;
+	}
+
+      if ((stalled == 1) && alive)
+	{
+	  recover_stall (alive > 0, input_fd, device_fd, status_fd, addrlist);
+	  send_pos = total_bytes;
+	  bjnp_split_reset (&splitter, send_pos);
+	  cmd_count = 0;
+	  stalled = 2;
 	}
 
 #if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR >= 3)
@@ -204,7 +1623,7 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
        * Check if we have a side-channel request ready (cups >= 1.3)...
        */
 
-      if (FD_ISSET (CUPS_SC_FD, &input))
+      if (ready & EV_SIDE_CHANNEL)
 	{
 	  /*
 	   * Do the side-channel request
@@ -269,20 +1688,29 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
        * Check if we have back-channel data (ack) ready...
        */
 
-      if (FD_ISSET (device_fd, &input))
+      if (ready & EV_DEVICE_IN)
 	{
 	  result = bjnp_backchannel (device_fd, &bytes);
+	  device_activity ();
+
+	  /*
+	   * The printer acks print data again after it timed out
+	   */
+
+	  if (stalled && ((result == BJNP_OK) || (result == BJNP_THROTTLE)))
+	    {
+	      fputs ("STATE: -timed-out-warning\n", stderr);
+	      stalled = 0;
+	    }
+
 	  switch (result)
 	    {
 	    case BJNP_IO_ERROR:
 	      perror ("ERROR: failed to read backchannel data");
-	      return (-1);
-	      break;
+	      lost = 1;
+	      continue;
 	    case BJNP_OK:
-	      print_bytes -= bytes;
-	      print_ptr += bytes;
 	      total_bytes += bytes;
-	      ack_pending = 0;
 
 	      /*
 	       * Success, reset paper out error conditions
@@ -299,17 +1727,19 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 	      break;
 	    case BJNP_THROTTLE:
 	      /*
-	       * Data not accepted by printer, check paper out condition
+	       * Data not accepted by printer, check paper out condition.
+	       * The response is handled when it arrives, only without a 
+	       * status socket we have to wait for it here
 	       */
 
-	      if ((paperout != 1)
+	      total_bytes += bytes;
+	      if ((paperout != 1) && (bjnp_status_request () < 0)
 		  && (bjnp_get_paper_status (addrlist) == BJNP_PAPER_OUT))
 		{
 		  fputs ("STATE: +media-empty-error\n", stderr);
 		  _cupsLangPuts (stderr, _("ERROR: Out of paper!\n"));
 		  paperout = 1;
 		}
-	      ack_pending = 0;
 	      break;
 
 	    case BJNP_NOT_AN_ACK:
@@ -320,54 +1750,113 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 	      /* no action */
 	      break;
 	    }
+
+	  /*
+	   * The job can be resumed from the last BJL command that the
+	   * printer acked all data before
+	   */
+
+	  while ((cmd_count > 0) && (cmd_sent[cmd_first] <= total_bytes))
+	    {
+	      boundary = cmd_sent[cmd_first];
+	      cmd_first = (cmd_first + 1) % BJNP_WINDOW_MAX;
+	      cmd_count--;
+	    }
+	  checkpoint = boundary;
+
+	  if (total_bytes - boundary > (ssize_t) replay)
+	    ring_start = total_bytes;
+	  else if (boundary > ring_start)
+	    ring_start = boundary;
+
+	  /*
+	   * When no packets are in flight, everything that was not acked 
+	   * must be sent (again). This resends data rejected by the printer
+	   */
+
+	  if (!bjnp_acks_pending () && (send_pos != total_bytes))
+	    {
+	      send_pos = total_bytes;
+	      bjnp_split_reset (&splitter, send_pos);
+	      cmd_count = 0;
+	    }
 	}
 
       /*
        * Check if we have print data ready...
        */
 
-      if (FD_ISSET (print_fd, &input))
+#ifdef HAVE_PTHREAD_H
+      if (reader.running)
+	{
+	  /*
+	   * Pass freed space to the reader thread and pick up new data
+	   */
+
+	  __atomic_store_n (&reader.ack_pos, ring_start, __ATOMIC_SEQ_CST);
+	  if (__atomic_load_n (&reader.reader_waiting, __ATOMIC_SEQ_CST))
+	    write (reader.space_pipe[1], "", 1);
+
+	  if (ready & EV_PRINT_DATA)
+	    while (read (reader.data_pipe[0], wakeup, sizeof (wakeup)) > 0);
+
+	  /* check eof first, so read_pos includes all data read */
+
+	  switch (__atomic_load_n (&reader.eof, __ATOMIC_SEQ_CST))
+	    {
+	    case 1:
+	      eof = 1;
+	      break;
+	    case -1:
+	      errno = reader.read_errno;
+	      perror ("ERROR: Unable to read print data");
+	      end_run_loop (owned_buffer);
+	      return (-1);
+	    }
+	  read_pos = __atomic_load_n (&reader.read_pos, __ATOMIC_SEQ_CST);
+	}
+      else
+#endif /* HAVE_PTHREAD_H */
+      if (!eof && (ready & EV_PRINT_DATA))
 	{
-	  if ((print_bytes = read (print_fd, print_buffer,
-				   sizeof (print_buffer))) < 0)
+	  /*
+	   * Read upto the end of the free space or the end of the ring
+	   */
+
+	  count = buffer_size - (read_pos - ring_start);
+	  if (count > buffer_size - (read_pos % buffer_size))
+	    count = buffer_size - (read_pos % buffer_size);
+
+	  bjnp_count_syscalls (1);
+	  if ((bytes = read (print_fd, print_buffer + (read_pos % buffer_size),
+			     count)) < 0)
 	    {
 	      /*
 	       * Read error - bail if we don't see EAGAIN or EINTR...
 	       */
 
-	      if (errno != EAGAIN || errno != EINTR)
+	      if (errno != EAGAIN && errno != EINTR)
 		{
 		  perror ("ERROR: Unable to read print data");
+		  end_run_loop (owned_buffer);
 		  return (-1);
 		}
-
-	      print_bytes = 0;
 	    }
-	  else if (print_bytes == 0)
+	  else if (bytes == 0)
 	    {
 	      /*
-	       * End of input file, break out of the loop
+	       * End of input file, finish when all data is acked
 	       */
 
-#if (CUPS_VERSION_MAJOR > 1) || (CUPS_VERSION_MINOR >= 3)
-	      if (draining)
-		{
-		  command = CUPS_SC_CMD_DRAIN_OUTPUT;
-		  status = CUPS_SC_STATUS_OK;
-		  datalen = 0;
-		  cupsSideChannelWrite (command, status, data, datalen, 1.0);
-		  draining = 0;
-		}
-#endif
-
-	      break;
+	      eof = 1;
+	      continue;
 	    }
 	  else
 	    {
-	      print_ptr = print_buffer;
+	      read_pos += bytes;
 
 	      fprintf (stderr, "DEBUG: Read %d bytes of print data...\n",
-		       (int) print_bytes);
+		       (int) bytes);
 	    }
 	}
 
@@ -376,9 +1865,25 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
        * send...
        */
 
-      if ((send_keep_alive || print_bytes) && FD_ISSET (device_fd, &output))
+      send_limit = bjnp_split_next (&splitter, print_buffer, buffer_size,
+				    send_pos, read_pos, eof);
+
+      if ((send_keep_alive || (send_pos < send_limit))
+	  && (ready & EV_DEVICE_OUT) && bjnp_write_ready ())
 	{
-	  bytes = bjnp_write (device_fd, print_ptr, print_bytes);
+	  /*
+	   * Send at most one packet, upto the next BJL command or the end 
+	   * of the ring
+	   */
+
+	  count = send_limit - send_pos;
+	  if (count > buffer_size - (send_pos % buffer_size))
+	    count = buffer_size - (send_pos % buffer_size);
+	  if (count > (size_t) bjnp_get_chunksize ())
+	    count = bjnp_get_chunksize ();
+
+	  bytes = bjnp_write (device_fd, print_buffer + (send_pos % buffer_size),
+			      count);
 	  send_keep_alive = 0;
 	  if (bytes < 0)
 	    {
@@ -406,12 +1911,12 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 		      offline = 1;
 		    }
 		}
-	      else if (errno != !EAGAIN && errno != EINTR && errno != ENOTTY)
+	      else if (errno != EAGAIN && errno != EINTR && errno != ENOTTY)
 		{
 		  fprintf (stderr,
 			   _("ERROR: Unable to write print data: %s\n"),
 			   strerror (errno));
-		  return (-1);
+		  lost = 1;
 		}
 	    }
 	  else
@@ -425,10 +1930,17 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
 		}
 
 	      /*
-	       * we sent data, wait for the ack before sending more data
+	       * we sent data, it stays in the buffer until it is acked
 	       */
 
-	      ack_pending = 1;
+	      if (bjnp_split_at_cmd (&splitter, send_pos)
+		  && (cmd_count < BJNP_WINDOW_MAX))
+		{
+		  cmd_sent[(cmd_first + cmd_count) % BJNP_WINDOW_MAX] = send_pos;
+		  cmd_count++;
+		}
+	      send_pos += bytes;
+	      device_activity ();
 	    }
 	}
     }
@@ -437,5 +1949,35 @@ bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
    * Return with success...
    */
 
+  end_run_loop (owned_buffer);
   return (total_bytes);
 }
+
+
+/*
+ * 'backendRunLoop()' - Read and write print and back-channel data.
+ */
+
+ssize_t				/* O - Total bytes on success, -1 on error */
+bjnp_backendRunLoop (int print_fd,	/* I - Print file descriptor */
+		     int device_fd,	/* I - Device file descriptor */
+		     http_addrlist_t * addrlist)
+					/* I - addresslist for printer */
+{
+  return (run_loop (print_fd, NULL, 0, device_fd, addrlist));
+}
+
+
+/*
+ * 'backendRunLoopBuffer()' - Write print data from memory, e.g. a mapped file.
+ */
+
+ssize_t				/* O - Total bytes on success, -1 on error */
+bjnp_backendRunLoopBuffer (const char *print_data,	/* I - Print data */
+			   size_t print_size,	/* I - Size of print data */
+			   int device_fd,	/* I - Device file descriptor */
+			   http_addrlist_t * addrlist)
+					/* I - addresslist for printer */
+{
+  return (run_loop (-1, print_data, print_size, device_fd, addrlist));
+}
@@ -16,7 +16,21 @@
  *
  * Contents:
  *
- *   main()    - Send a file to the printer or server.
+ *   main()                   - Send a file to the printer or server.
+ *   spool_print_data()       - Copy print data to a temporary file.
+ *   map_print_file()         - Map the print file into memory.
+ *   skip_print_data()        - Skip print data that was sent before.
+ *   load_checkpoint()        - Read where an interrupted job can be resumed.
+ *   save_checkpoint()        - Record where an interrupted job can be resumed.
+ *   wait_printer_up()        - Wait until the printer can be reached again.
+ *   list_printer()           - List a printer found by discovery.
+ *   cache_file_name()        - Get the name of a discovery cache file.
+ *   read_discover_cache()    - Read the printers found by the last discovery.
+ *   write_discover_cache()   - Record the printers found by discovery.
+ *   lock_discover_cache()    - Lock the discovery cache for a discovery.
+ *   refresh_discover_cache() - Refresh the discovery cache in the background.
+ *   list_cached_printers()   - List the printers in the discovery cache.
+ *   discover_printers()      - List the printers on the network.
  *   side_cb() - removed and integrated in main loop of RunLoop
  *   wait_bc() - removed as bjnp does not have a true backchannel
  *               it is used to send acks only
@@ -40,7 +54,697 @@
 #  include <netinet/in.h>
 #  include <arpa/inet.h>
 #  include <netdb.h>
+#  include <sys/time.h>
 #endif /* WIN32 */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#  include <sys/mman.h>
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+
+
+/*
+ * 'spool_print_data()' - Copy print data to a temporary file.
+ *
+ * Used for print data from stdin that must be sent more than once, so
+ * the input is read only once whatever the nr of copies.
+ */
+
+static int			/* O - File descriptor or -1 on error */
+spool_print_data (int fd)	/* I - File descriptor to read from */
+{
+  char buffer[65536];		/* Copy buffer */
+  char filename[1024];		/* Temporary file name */
+  const char *tmpdir;		/* Directory for temporary files */
+  ssize_t bytes,		/* Bytes read */
+    written,			/* Bytes written */
+    result,			/* Result of write */
+    total;			/* Total bytes spooled */
+  int spool_fd;			/* Temporary file */
+
+  if ((tmpdir = getenv ("TMPDIR")) == NULL)
+    tmpdir = "/tmp";
+
+  snprintf (filename, sizeof (filename), "%s/bjnp-XXXXXX", tmpdir);
+  if ((spool_fd = mkstemp (filename)) < 0)
+    {
+      perror ("ERROR: unable to create spool file");
+      return (-1);
+    }
+
+  /*
+   * the file is only used by us, remove its name right away 
+   */
+
+  unlink (filename);
+
+  for (total = 0;;)
+    {
+      if ((bytes = read (fd, buffer, sizeof (buffer))) < 0)
+	{
+	  if (errno == EAGAIN || errno == EINTR)
+	    continue;
+
+	  perror ("ERROR: Unable to read print data");
+	  close (spool_fd);
+	  return (-1);
+	}
+      else if (bytes == 0)
+	break;
+
+      for (written = 0; written < bytes; written += result)
+	{
+	  if ((result = write (spool_fd, buffer + written, bytes - written)) < 0)
+	    {
+	      if (errno != EINTR)
+		{
+		  perror ("ERROR: unable to write spool file");
+		  close (spool_fd);
+		  return (-1);
+		}
+	      result = 0;
+	    }
+	}
+      total += bytes;
+    }
+
+  fprintf (stderr, "DEBUG: Spooled %ld bytes of print data\n", (long) total);
+  return (spool_fd);
+}
+
+
+/*
+ * 'map_print_file()' - Map the print file into memory.
+ *
+ * Returns NULL when the file can not be mapped, the file is then read 
+ * by the run loop instead.
+ */
+
+static char *			/* O - Mapped print data or NULL */
+map_print_file (int fd,		/* I - Print file descriptor */
+		size_t * size)	/* O - Size of print data */
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  struct stat info;		/* File information */
+  char *data;			/* Mapped print data */
+
+  if ((fstat (fd, &info) < 0) || !S_ISREG (info.st_mode)
+      || (info.st_size == 0))
+    return (NULL);
+
+  if ((data = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED)
+    {
+      fprintf (stderr, "DEBUG: Unable to map print file: %s\n",
+	       strerror (errno));
+      return (NULL);
+    }
+
+#  ifdef MADV_SEQUENTIAL
+  madvise (data, info.st_size, MADV_SEQUENTIAL);
+#  endif /* MADV_SEQUENTIAL */
+
+  *size = info.st_size;
+  return (data);
+#else
+  (void) fd;
+  (void) size;
+  return (NULL);
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+}
+
+
+/*
+ * 'skip_print_data()' - Skip print data that was sent before.
+ */
+
+static int			/* O - 0 on success, -1 on error */
+skip_print_data (int fd,	/* I - File descriptor to read from */
+		 ssize_t count)	/* I - Nr of bytes to skip */
+{
+  char buffer[65536];		/* Read buffer */
+  ssize_t bytes;		/* Bytes read */
+
+  while (count > 0)
+    {
+      if ((bytes = read (fd, buffer,
+			 count < (ssize_t) sizeof (buffer) ? count :
+			 (ssize_t) sizeof (buffer))) < 0)
+	{
+	  if (errno == EAGAIN || errno == EINTR)
+	    continue;
+
+	  perror ("ERROR: Unable to read print data");
+	  return (-1);
+	}
+      else if (bytes == 0)
+	{
+	  fputs ("ERROR: Print data is shorter than before\n", stderr);
+	  return (-1);
+	}
+      count -= bytes;
+    }
+  return (0);
+}
+
+
+/*
+ * 'load_checkpoint()' - Read where an interrupted job can be resumed.
+ *
+ * The checkpoint is only used when the print data has the same size as
+ * when it was written (0 for data from stdin).
+ */
+
+static void
+load_checkpoint (const char *filename,	/* I - Checkpoint file */
+		 size_t print_size,	/* I - Size of print data */
+		 int *copy,		/* O - Copy to resume */
+		 ssize_t * offset)	/* O - Offset to resume from */
+{
+  FILE *fp;			/* Checkpoint file */
+  int c;			/* Copy read */
+  long o;			/* Offset read */
+  unsigned long size;		/* Size of print data read */
+
+  *copy = 0;
+  *offset = 0;
+
+  if ((fp = fopen (filename, "r")) == NULL)
+    return;
+
+  if ((fscanf (fp, "%d %ld %lu", &c, &o, &size) == 3) && (c >= 0)
+      && (o >= 0) && (size == print_size)
+      && ((print_size == 0) || (o < (long) print_size)))
+    {
+      *copy = c;
+      *offset = o;
+      _cupsLangPrintf (stderr,
+		       _("INFO: Resuming job at copy %d, offset %ld\n"),
+		       c + 1, o);
+    }
+  fclose (fp);
+}
+
+
+/*
+ * 'save_checkpoint()' - Record where an interrupted job can be resumed.
+ *
+ * The file is kept with the temporary files of the job, so a retry of 
+ * the job does not start from scratch.
+ */
+
+static void
+save_checkpoint (const char *filename,	/* I - Checkpoint file */
+		 size_t print_size,	/* I - Size of print data */
+		 int copy,		/* I - Copy to resume */
+		 ssize_t offset)	/* I - Offset to resume from */
+{
+  FILE *fp;			/* Checkpoint file */
+
+  if ((copy == 0) && (offset == 0))
+    {
+      unlink (filename);
+      return;
+    }
+
+  if ((fp = fopen (filename, "w")) == NULL)
+    {
+      perror ("DEBUG: Unable to write checkpoint");
+      return;
+    }
+
+  fprintf (fp, "%d %ld %lu\n", copy, (long) offset,
+	   (unsigned long) print_size);
+  fclose (fp);
+  fprintf (stderr, "DEBUG: Job can be resumed at copy %d, offset %ld\n",
+	   copy + 1, (long) offset);
+}
+
+
+/*
+ * 'wait_printer_idle()' - Wait until the printer is ready for a new job.
+ *
+ * Some printers hang when the next job starts too soon (reported by 
+ * Zedonet for PIXMA MX7600), so we poll the printer status until it is
+ * neither busy nor printing. When the printer does not report its 
+ * status, we wait the full time unless the job was cancelled.
+ */
+
+static void
+wait_printer_idle (http_addrlist_t * addr,	/* I - Printer address */
+		   int seconds,	/* I - Max. time to wait */
+		   int cancelled)	/* I - Job was cancelled? */
+{
+  int polls;			/* Nr of status polls left */
+  int idle;			/* Printer idle? */
+
+  for (polls = seconds * (1000000 / BJNP_IDLE_POLL_USEC);; polls--)
+    {
+      if ((idle = bjnp_printer_idle (addr)) == 1)
+	{
+	  fprintf (stderr, "DEBUG: Printer is idle after %d status polls\n",
+		   seconds * (1000000 / BJNP_IDLE_POLL_USEC) - polls + 1);
+	  return;
+	}
+
+      if (idle < 0)
+	{
+	  if (!cancelled && (polls > 0))
+	    {
+	      fputs ("DEBUG: Printer status unknown, using fixed delay\n",
+		     stderr);
+	      sleep ((polls * BJNP_IDLE_POLL_USEC + 999999) / 1000000);
+	    }
+	  return;
+	}
+
+      if (polls <= 0)
+	{
+	  fputs ("DEBUG: Printer still busy, not waiting any longer\n",
+		 stderr);
+	  return;
+	}
+
+      usleep (BJNP_IDLE_POLL_USEC);
+    }
+}
+
+
+/*
+ * 'wait_printer_up()' - Wait until the printer can be reached again.
+ *
+ * Instead of sleeping a fixed time after a failed connect, the printer 
+ * status is probed with a jittered exponential backoff, so we reconnect
+ * as soon as the printer wakes up from power save. A printer that answers
+ * but is busy with another job is probed until it is done.
+ */
+
+static void
+wait_printer_up (http_addrlist_t * addr,	/* I - Printer address */
+		 int seconds)	/* I - Max. time to wait */
+{
+  struct timeval start;		/* Start of wait */
+  struct timeval now;		/* Current time */
+  long interval;		/* Probe interval without jitter (usec) */
+  long wait;			/* Time to wait for this probe (usec) */
+  long waited;			/* Time waited so far (usec) */
+  int probes;			/* Nr of probes sent */
+  int up;			/* Printer state */
+
+  gettimeofday (&start, NULL);
+  interval = BJNP_PROBE_MIN_USEC;
+
+  for (probes = 1, waited = 0; waited < seconds * 1000000L; probes++)
+    {
+      /*
+       * Jitter the interval, so queues waiting for the same printer
+       * do not all probe at the same time
+       */
+
+      wait = interval * (75 + rand () % 50) / 100;
+      if (wait > seconds * 1000000L - waited)
+	wait = seconds * 1000000L - waited;
+
+      if ((up = bjnp_probe_printer (addr, wait)) == 1)
+	{
+	  fprintf (stderr, "DEBUG: Printer responded to probe %d\n", probes);
+	  break;
+	}
+
+      gettimeofday (&now, NULL);
+      if (up == 0)
+	{
+	  /* printer answered, but is busy: wait the rest of the interval */
+
+	  usleep (wait - ((now.tv_sec - start.tv_sec) * 1000000L +
+			  now.tv_usec - start.tv_usec - waited));
+	  gettimeofday (&now, NULL);
+	}
+      waited = (now.tv_sec - start.tv_sec) * 1000000L +
+	now.tv_usec - start.tv_usec;
+
+      if ((interval *= 2) > BJNP_PROBE_MAX_USEC)
+	interval = BJNP_PROBE_MAX_USEC;
+    }
+  bjnp_status_close ();
+}
+
+
+/*
+ * 'list_printer()' - List a printer found by discovery.
+ *
+ * Called as soon as the printer is identified, the output is flushed so
+ * cups sees each printer without waiting for discovery to end.
+ */
+
+static void
+list_printer (const struct printer_list *printer)	/* I - Printer found */
+{
+  printf ("network bjnp://%s:%u \"%s\" \"%s %s\" \"%s\"\n",
+	  printer->hostname,
+	  printer->port,
+	  printer->model,
+	  printer->model, printer->hostname, printer->IEEE1284_id);
+  fflush (stdout);
+}
+
+
+/*
+ * 'cache_file_name()' - Get the name of a discovery cache file.
+ *
+ * The cache is kept in the cups cache directory, so all discoveries on
+ * the host share it.
+ */
+
+static void
+cache_file_name (char *name,		/* O - File name */
+		 size_t size,		/* I - Size of name */
+		 const char *suffix)	/* I - File name suffix */
+{
+  const char *dir;			/* Cache directory */
+
+  if (((dir = getenv ("CUPS_CACHEDIR")) == NULL) &&
+      ((dir = getenv ("TMPDIR")) == NULL))
+    dir = "/tmp";
+  snprintf (name, size, "%s/bjnp-discover.%s", dir, suffix);
+}
+
+
+/*
+ * 'read_discover_cache()' - Read the printers found by the last discovery.
+ *
+ * The cache file is mapped into memory and checked before the printers 
+ * are copied, the file is replaced as a whole when it is written.
+ */
+
+static int				/* O - Nr of printers, -1 on error */
+read_discover_cache (struct printer_list **list,	/* O - Printers */
+		     time_t * age)	/* O - Age of cache in seconds */
+{
+  char filename[1024];			/* Cache file */
+  int fd;				/* Cache file descriptor */
+  struct stat st;			/* Cache file info */
+  struct discover_cache *cache;		/* Cache contents */
+  int count = -1;			/* Nr of printers */
+
+  *list = NULL;
+  cache_file_name (filename, sizeof (filename), "cache");
+  if ((fd = open (filename, O_RDONLY)) < 0)
+    return (-1);
+
+  if ((fstat (fd, &st) != 0) || (st.st_size < (off_t) sizeof (*cache)))
+    {
+      close (fd);
+      return (-1);
+    }
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  if ((cache = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+      MAP_FAILED)
+    cache = NULL;
+#else
+  if (((cache = malloc (st.st_size)) != NULL) &&
+      (read (fd, cache, st.st_size) != st.st_size))
+    {
+      free (cache);
+      cache = NULL;
+    }
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+  close (fd);
+  if (cache == NULL)
+    return (-1);
+
+  if ((memcmp (cache->magic, BJNP_DISCOVER_CACHE_MAGIC,
+	       sizeof (cache->magic)) == 0) &&
+      (cache->entry_size == sizeof (struct printer_list)) &&
+      (st.st_size == (off_t) (sizeof (*cache) +
+			      cache->count * sizeof (struct printer_list))) &&
+      ((*list = malloc ((cache->count + 1) *
+			sizeof (struct printer_list))) != NULL))
+    {
+      memcpy (*list, cache + 1, cache->count * sizeof (struct printer_list));
+      count = cache->count;
+      *age = time (NULL) - (time_t) cache->updated;
+    }
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  munmap (cache, st.st_size);
+#else
+  free (cache);
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+  return (count);
+}
+
+
+/*
+ * 'write_discover_cache()' - Record the printers found by discovery.
+ *
+ * The cache is written to a temporary file that replaces the cache, so 
+ * readers never see a partial update.
+ */
+
+static void
+write_discover_cache (struct printer_list *list,	/* I - Printers */
+		      int count)	/* I - Nr of printers */
+{
+  char filename[1024];			/* Cache file */
+  char tmpname[1040];			/* Temporary file */
+  struct discover_cache cache;		/* Cache header */
+  int fd;				/* Temporary file descriptor */
+
+  memset (&cache, 0, sizeof (cache));
+  memcpy (cache.magic, BJNP_DISCOVER_CACHE_MAGIC, sizeof (cache.magic));
+  cache.entry_size = sizeof (struct printer_list);
+  cache.count = count;
+  cache.updated = time (NULL);
+
+  cache_file_name (filename, sizeof (filename), "cache");
+  snprintf (tmpname, sizeof (tmpname), "%s.XXXXXX", filename);
+  if ((fd = mkstemp (tmpname)) < 0)
+    {
+      bjnp_debug (LOG_INFO, "Can not write discovery cache: %s\n",
+		  strerror (errno));
+      return;
+    }
+  fchmod (fd, 0644);
+
+  if ((write (fd, &cache, sizeof (cache)) != sizeof (cache)) ||
+      (write (fd, list, count * sizeof (struct printer_list)) !=
+       (ssize_t) (count * sizeof (struct printer_list))) ||
+      (close (fd) != 0) || (rename (tmpname, filename) != 0))
+    {
+      bjnp_debug (LOG_INFO, "Can not write discovery cache: %s\n",
+		  strerror (errno));
+      close (fd);
+      unlink (tmpname);
+    }
+}
+
+
+/*
+ * 'lock_discover_cache()' - Lock the discovery cache for a discovery.
+ *
+ * Only the process that holds the lock broadcasts, so there is only one
+ * discovery in progress per host. The lock is released when the process 
+ * closes the file or ends.
+ */
+
+static int				/* O - Lock file descriptor, -1 on */
+					/*     error, -2 if not locked in time */
+lock_discover_cache (long wait)		/* I - Max. time to wait in usec, */
+					/*     -1 = forever */
+{
+  char filename[1024];			/* Lock file */
+  int fd;				/* Lock file descriptor */
+  struct flock lock;			/* Lock request */
+
+  cache_file_name (filename, sizeof (filename), "lock");
+  if ((fd = open (filename, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+      bjnp_debug (LOG_INFO, "Can not open discovery lock: %s\n",
+		  strerror (errno));
+      return (-1);
+    }
+
+  memset (&lock, 0, sizeof (lock));
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+
+  if (wait < 0)
+    {
+      while (fcntl (fd, F_SETLKW, &lock) != 0)
+	if (errno != EINTR)
+	  {
+	    close (fd);
+	    return (-1);
+	  }
+      return (fd);
+    }
+
+  while (fcntl (fd, F_SETLK, &lock) != 0)
+    {
+      if ((errno != EACCES) && (errno != EAGAIN))
+	{
+	  close (fd);
+	  return (-1);
+	}
+      if (wait <= 0)
+	{
+	  close (fd);
+	  return (-2);
+	}
+      usleep (BJNP_CACHE_LOCK_POLL_USEC);
+      wait -= BJNP_CACHE_LOCK_POLL_USEC;
+    }
+  return (fd);
+}
+
+
+/*
+ * 'refresh_discover_cache()' - Refresh the discovery cache in the background.
+ *
+ * A child process waits for the discovery lock and discovers the printers
+ * unless the cache was refreshed in the mean time. Its output goes to
+ * /dev/null, so cups does not wait for it.
+ */
+
+static void
+refresh_discover_cache (long wait)	/* I - Max. time to wait for the */
+					/*     lock in usec, -1 = forever */
+{
+  struct printer_list *printers;	/* Printers found */
+  int count;				/* Nr of printers */
+  time_t age;				/* Age of cache */
+  int fd;				/* /dev/null or lock file */
+  pid_t pid;				/* Child process */
+
+  if ((pid = fork ()) != 0)
+    {
+      if (pid < 0)
+	bjnp_debug (LOG_INFO, "Can not refresh discovery cache: %s\n",
+		    strerror (errno));
+      return;
+    }
+
+  if ((fd = open ("/dev/null", O_RDWR)) >= 0)
+    {
+      dup2 (fd, 0);
+      dup2 (fd, 1);
+      dup2 (fd, 2);
+      if (fd > 2)
+	close (fd);
+    }
+  setsid ();
+
+  if (lock_discover_cache (wait) < 0)
+    _exit (0);
+
+  if ((count = read_discover_cache (&printers, &age)) >= 0 &&
+      (age >= 0) && (age < BJNP_DISCOVER_REFRESH_SEC))
+    _exit (0);
+  free (printers);
+
+  bjnp_debug (LOG_DEBUG, "Refreshing discovery cache\n");
+  count = bjnp_discover_printers (&printers, NULL, 0, 0);
+  write_discover_cache (printers, count);
+  _exit (0);
+}
+
+
+/*
+ * 'list_cached_printers()' - List the printers in the discovery cache.
+ */
+
+static int				/* O - Nr of printers listed, -1 if */
+					/*     cache is missing or expired */
+list_cached_printers (int ttl,		/* I - Max. age of cache in seconds */
+		      int expected,	/* I - Nr of printers expected, 0 = any */
+		      time_t * age)	/* O - Age of cache in seconds */
+{
+  struct printer_list *printers;	/* Printers in cache */
+  int count;				/* Nr of printers in cache */
+  int i;				/* Looping var */
+
+  if (((count = read_discover_cache (&printers, age)) < 0) ||
+      (*age < 0) || (*age >= ttl))
+    {
+      free (printers);
+      return (-1);
+    }
+
+  bjnp_debug (LOG_DEBUG, "Listing %d printers from discovery cache, "
+	      "age %d seconds\n", count, (int) *age);
+  if ((expected > 0) && (count > expected))
+    count = expected;
+  for (i = 0; i < count; i++)
+    list_printer (&printers[i]);
+  free (printers);
+  return (count);
+}
+
+
+/*
+ * 'discover_printers()' - List the printers on the network.
+ *
+ * Printers are listed from the discovery cache when it is younger than
+ * ttl seconds, a cache older than BJNP_DISCOVER_REFRESH_SEC is refreshed 
+ * in the background. Otherwise the printers are discovered and listed as 
+ * they are found, after a discovery in progress in another process is 
+ * done.
+ */
+
+static int				/* O - Nr of printers listed */
+discover_printers (int ttl,		/* I - Max. age of cache in seconds, */
+					/*     0 = no cache */
+		   int expected,	/* I - Nr of printers expected, 0 = any */
+		   long deadline)	/* I - Max. time in usec, 0 = none */
+{
+  struct printer_list *printers;	/* Printers found */
+  int count;				/* Nr of printers found */
+  time_t age;				/* Age of cache */
+  int lock_fd = -1;			/* Discovery lock */
+
+  if (ttl > 0)
+    {
+      if ((count = list_cached_printers (ttl, expected, &age)) >= 0)
+	{
+	  if (age >= BJNP_DISCOVER_REFRESH_SEC)
+	    refresh_discover_cache (0);
+	  return (count);
+	}
+
+      /* wait for a discovery in progress, it may fill the cache */
+
+      if ((lock_fd = lock_discover_cache (deadline > 0 ? deadline : -1)) ==
+	  -2)
+	{
+	  bjnp_debug (LOG_INFO, "Discovery in progress did not end in time\n");
+	  return (0);
+	}
+      if ((lock_fd >= 0) &&
+	  ((count = list_cached_printers (ttl, expected, &age)) >= 0))
+	{
+	  close (lock_fd);
+	  return (count);
+	}
+
+      /*
+       * A discovery that may end early does not fill the cache, a child 
+       * process refreshes it when this discovery is done
+       */
+
+      if ((lock_fd >= 0) && ((expected > 0) || (deadline > 0)))
+	refresh_discover_cache (-1);
+    }
+
+  count = bjnp_discover_printers (&printers, list_printer, expected,
+				  deadline);
+  if ((lock_fd >= 0) && (expected <= 0) && (deadline <= 0))
+    write_discover_cache (printers, count);
+  free (printers);
+
+  if (lock_fd >= 0)
+    close (lock_fd);
+  return (count);
+}
 
 
 /*
@@ -64,11 +768,21 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
    *value,			/* Value of option */
     sep;			/* Option separator */
   int print_fd;			/* Print file */
+  char *print_data;		/* Mapped print file or NULL */
+  size_t print_size;		/* Size of mapped print file */
   int copies;			/* Number of copies to print */
+  int copy;			/* Copy being printed */
+  int resume_copy;		/* Copy to resume an interrupted job at */
+  ssize_t resume_offset;	/* Offset in it to resume from */
+  ssize_t offset;		/* Offset to start copy at */
+  char checkpoint[1024];	/* Checkpoint file of the job */
+  const char *tmpdir;		/* Directory for temporary files */
   time_t start_time;		/* Time of first connect */
   int recoverable;		/* Recoverable error shown? */
   int contimeout;		/* Connection timeout */
   int waiteof;			/* Wait for end-of-file? */
+  int finishwait;		/* Max. wait for idle printer after job */
+  int zerocopy;			/* Send print data with MSG_ZEROCOPY? */
   int port;			/* Port number */
   char portname[255];		/* Port name */
   int delay;			/* Delay for retries... */
@@ -80,6 +794,10 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
   char addrname[256];		/* Address name */
   ssize_t tbytes;		/* Total number of bytes written */
   char *bjnp_debugstr;		/* environment string */
+  int throttle_count;		/* nr of times printer throttled */
+  long throttle_msec;		/* time spent throttling */
+  unsigned long syscalls;	/* nr of system calls made for the job */
+  unsigned long acked;		/* nr of bytes acked by the printer */
 #if defined(HAVE_SIGACTION) && !defined(HAVE_SIGSET)
   struct sigaction action;	/* Actions for POSIX signals */
 #endif /* HAVE_SIGACTION && !HAVE_SIGSET */
@@ -118,22 +836,32 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 
   if (argc == 1)
     {
-      struct printer_list printers[256];
-      int num_printers;
-      int i;
+      const char *value;
+      long deadline = 0;
+      int expected = 0;
+      int ttl = BJNP_DISCOVER_CACHE_TTL;
 
-      if ((num_printers = bjnp_discover_printers (printers)) == 0)
+      /*
+       * Discovery can end at a deadline (in seconds) or as soon as the
+       * expected nr of printers is found. The discover broadcast is sent 
+       * more than once to allow for packet loss, on the interfaces that
+       * match BJNP_DISCOVER_INTERFACES and not BJNP_DISCOVER_EXCLUDE.
+       * The printers found are cached for BJNP_DISCOVER_CACHE_TTL seconds
+       */
+
+      if ((value = getenv ("BJNP_DISCOVER_TIMEOUT")) != NULL)
+	deadline = (long) (atof (value) * 1000000);
+      if ((value = getenv ("BJNP_DISCOVER_COUNT")) != NULL)
+	expected = atoi (value);
+      if ((value = getenv ("BJNP_DISCOVER_ROUNDS")) != NULL)
+	bjnp_set_discover_rounds (atoi (value));
+      bjnp_set_discover_interfaces (getenv ("BJNP_DISCOVER_INTERFACES"),
+				    getenv ("BJNP_DISCOVER_EXCLUDE"));
+      if ((value = getenv ("BJNP_DISCOVER_CACHE_TTL")) != NULL)
+	ttl = atoi (value);
+
+      if (discover_printers (ttl, expected, deadline) == 0)
 	puts ("network bjnp \"Unknown\" \"Canon network printer\"");
-      else
-	for (i = 0; i < num_printers; i++)
-	  {
-	    printf ("network bjnp://%s:%u \"%s\" \"%s %s\" \"%s\"\n",
-		    printers[i].hostname,
-		    printers[i].port,
-		    printers[i].model,
-		    printers[i].model,
-		    printers[i].hostname, printers[i].IEEE1284_id);
-	  }
 
       return (CUPS_BACKEND_OK);
     }
@@ -155,7 +883,15 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
   if (argc == 6)
     {
       print_fd = 0;
-      copies = 1;
+      copies = atoi (argv[4]);
+
+      /*
+       * When stdin must be sent more than once, spool it so it is read 
+       * only once and treat it like a print file
+       */
+
+      if ((copies > 1) && ((print_fd = spool_print_data (0)) < 0))
+	return (CUPS_BACKEND_FAILED);
     }
   else
     {
@@ -172,6 +908,26 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
       copies = atoi (argv[4]);
     }
 
+  /*
+   * Print files are sent straight from memory when they can be mapped...
+   */
+
+  print_data = NULL;
+  print_size = 0;
+  if (print_fd != 0)
+    print_data = map_print_file (print_fd, &print_size);
+
+  /*
+   * When the job was interrupted before, continue where it stopped
+   */
+
+  if ((tmpdir = getenv ("TMPDIR")) == NULL)
+    tmpdir = "/tmp";
+
+  snprintf (checkpoint, sizeof (checkpoint), "%s/bjnp-%s.checkpoint", tmpdir,
+	    argv[1]);
+  load_checkpoint (checkpoint, print_size, &resume_copy, &resume_offset);
+
   /*
    * Extract the hostname and port number from the URI...
    */
@@ -189,7 +945,9 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
    */
 
   waiteof = 1;
+  zerocopy = 0;
   contimeout = 7 * 24 * 60 * 60;
+  finishwait = BJNP_FINISH_WAIT;
 
   if ((options = strchr (resource, '?')) != NULL)
     {
@@ -258,6 +1016,79 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 	      if (atoi (value) > 0)
 		contimeout = atoi (value);
 	    }
+	  else if (!strcasecmp (name, "zerocopy"))
+	    {
+	      /*
+	       * Set the zerocopy value...
+	       */
+
+	      zerocopy = !value[0] || !strcasecmp (value, "on") ||
+		!strcasecmp (value, "yes") || !strcasecmp (value, "true");
+	    }
+	  else if (!strcasecmp (name, "chunksize"))
+	    {
+	      /*
+	       * Set the print packet size, auto probes for the best size...
+	       */
+
+	      if (!strcasecmp (value, "auto"))
+		bjnp_set_chunksize (0);
+	      else if (atoi (value) > 0)
+		bjnp_set_chunksize (atoi (value));
+	    }
+	  else if (!strcasecmp (name, "readahead"))
+	    {
+	      /*
+	       * Read print data in a separate thread into a ring of this size...
+	       */
+
+	      if (atoi (value) > 0)
+		bjnp_backendSetReadahead (atoi (value));
+	    }
+	  else if (!strcasecmp (name, "engine"))
+	    {
+	      /*
+	       * Select the event engine: select, epoll or io_uring...
+	       */
+
+	      bjnp_backendSetEngine (value);
+	    }
+	  else if (!strcasecmp (name, "finishwait"))
+	    {
+	      /*
+	       * Set the max. time to wait for the printer after a job...
+	       */
+
+	      if (atoi (value) >= 0)
+		finishwait = atoi (value);
+	    }
+	  else if (!strcasecmp (name, "replay"))
+	    {
+	      /*
+	       * Set the nr of acked bytes kept to resume a job from stdin...
+	       */
+
+	      if (atoi (value) >= 0)
+		bjnp_backendSetReplay (atoi (value));
+	    }
+	  else if (!strcasecmp (name, "acktimeout"))
+	    {
+	      /*
+	       * Set the time the printer may take to ack print data...
+	       */
+
+	      if (atoi (value) >= 0)
+		bjnp_set_ack_timeout (atoi (value));
+	    }
+	  else if (!strcasecmp (name, "window"))
+	    {
+	      /*
+	       * Set the nr of print packets that may wait for an ack...
+	       */
+
+	      if (atoi (value) > 0)
+		bjnp_set_window (atoi (value));
+	    }
 	  else if (!strcasecmp (name, "debuglevel"))
 	    {
 	      bjnp_set_debug_level (value);
@@ -298,10 +1129,12 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 
   fputs ("STATE: +connecting-to-device\n", stderr);
 
+  srand (time (NULL) ^ getpid ());
+
   for (delay = 5;;)
     {
-      if ((addr = bjnp_send_job_details (addrlist, argv[2], argv[3])) == NULL
-	  || (addr = httpAddrConnect (addrlist, &device_fd)) == NULL)
+      if ((addr = bjnp_start_job (addrlist, argv[2], argv[3], &device_fd))
+	  == NULL)
 	{
 	  error = errno;
 	  device_fd = -1;
@@ -344,10 +1177,10 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 	      _cupsLangPrintf (stderr,
 			       _
 			       ("WARNING: recoverable: Network host \'%s\' is busy; "
-				"will retry in %d seconds...\n"), hostname,
+				"will retry within %d seconds...\n"), hostname,
 			       delay);
 
-	      sleep (delay);
+	      wait_printer_up (addrlist, delay);
 
 	      if (delay < 30)
 		delay += 5;
@@ -361,8 +1194,8 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 	      _cupsLangPuts (stderr,
 			     _
 			     ("ERROR: recoverable: Unable to connect to printer; "
-			      "will retry in 30 seconds...\n"));
-	      sleep (30);
+			      "will retry within 30 seconds...\n"));
+	      wait_printer_up (addrlist, 30);
 	    }
 	}
       else
@@ -370,16 +1203,7 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
     }
 
   if (recoverable)
-    {
-      /*
-       * If we've shown a recoverable error make sure the printer proxies
-       * have a chance to see the recovered message. Not pretty but
-       * necessary for now...
-       */
-
-      fputs ("INFO: recovered: \n", stderr);
-      sleep (5);
-    }
+    fputs ("INFO: recovered: \n", stderr);
 
   fputs ("STATE: -connecting-to-device\n", stderr);
   _cupsLangPrintf (stderr, _("INFO: Connected to %s...\n"), hostname);
@@ -396,23 +1220,50 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
 	     httpAddrString (&addr->addr, addrname, sizeof (addrname)),
 	     ntohs (addr->addr.ipv4.sin_port));
 
+  if (zerocopy)
+    bjnp_enable_zerocopy (device_fd);
+
   /*
    * Print everything...
    */
 
   tbytes = 0;
 
-  while (copies > 0 && tbytes >= 0)
+  for (copy = 0; (copy < copies) && (tbytes >= 0); copy++)
     {
-      copies--;
+      /*
+       * Copies that were printed before are skipped
+       */
+
+      if (copy < resume_copy)
+	continue;
+
+      offset = (copy == resume_copy) ? resume_offset : 0;
 
       if (print_fd != 0)
+	fputs ("PAGE: 1 1\n", stderr);
+
+      if (print_data)
+	tbytes = bjnp_backendRunLoopBuffer (print_data + offset,
+					    print_size - offset, device_fd,
+					    addr);
+      else if ((print_fd == 0) && (skip_print_data (0, offset) < 0))
+	tbytes = -1;
+      else
 	{
-	  fputs ("PAGE: 1 1\n", stderr);
-	  lseek (print_fd, 0, SEEK_SET);
+	  if (print_fd != 0)
+	    lseek (print_fd, offset, SEEK_SET);
+
+	  tbytes = bjnp_backendRunLoop (print_fd, device_fd, addr);
 	}
 
-      tbytes = bjnp_backendRunLoop (print_fd, device_fd, addr);
+      /*
+       * Record where the job can be resumed when it is retried
+       */
+
+      if ((tbytes < 0) && !bjnp_backendCancelled ())
+	save_checkpoint (checkpoint, print_size, copy,
+			 offset + bjnp_backendGetCheckpoint ());
 
       if (print_fd != 0 && tbytes >= 0)
 	{
@@ -429,6 +1280,19 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
     }
 
 
+  /*
+   * Report how much time the printer made us wait
+   */
+
+  bjnp_get_throttle_stats (&throttle_count, &throttle_msec);
+  fprintf (stderr, "DEBUG: Printer throttled %d times, %ld.%03ld seconds in total\n",
+	   throttle_count, throttle_msec / 1000, throttle_msec % 1000);
+
+  bjnp_get_syscall_stats (&syscalls, &acked);
+  if (acked > 0)
+    fprintf (stderr, "DEBUG: %lu system calls, %.1f per MB acked by printer\n",
+	     syscalls, syscalls * 1048576.0 / acked);
+
   /*
    * Close the socket connection...
    */
@@ -440,21 +1304,37 @@ main (int argc,			/* I - Number of command-line arguments (6 or 7) */
    */
   bjnp_finish_job (addr);
 
-  httpAddrFreeList (addrlist);
+  /*
+   * A printer identity that was not cached is looked up now that it no
+   * longer delays the job
+   */
+
+  if (!bjnp_backendCancelled ())
+    bjnp_refresh_printer_id ();
 
   /*
-   * delay a bit as otherwise next job may hang (reported by Zedonet for PIXMA MX7600) 
-   */ 
+   * The next job can start as soon as the printer is idle again
+   */
+
+  wait_printer_idle (addr, finishwait, bjnp_backendCancelled ());
 
-  sleep(15);
+  httpAddrFreeList (addrlist);
 
   /*
    * Close the input file and return...
    */
 
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  if (print_data)
+    munmap (print_data, print_size);
+#endif /* HAVE_SYS_MMAN_H && HAVE_MMAP */
+
   if (print_fd != 0)
     close (print_fd);
 
+  if ((tbytes >= 0) || bjnp_backendCancelled ())
+    unlink (checkpoint);
+
   if (tbytes >= 0)
     _cupsLangPuts (stderr, _("INFO: Ready to print.\n"));
 
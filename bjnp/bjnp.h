@@ -142,10 +142,53 @@ typedef enum bjnp_paper_status_e
  *  BJNP definitions 
  */
 
-#define BJNP_PRINTBUF_MAX 4096	/* size of printbuffer */
+#define BJNP_PRINTBUF_MAX 4096	/* default size of print packets */
+#define BJNP_CHUNK_MAX 65536	/* max. size of print packets */
+#define BJNP_CHUNK_PROBES 8	/* nr of packets acked before a larger */
+				/* packet size is tried */
+#define BJNP_THROTTLE_MIN_USEC 5000	/* first delay after printer throttles */
+#define BJNP_THROTTLE_PRINTING_USEC 160000	/* max. delay while printing */
+#define BJNP_THROTTLE_MAX_USEC 1000000	/* max. delay when busy otherwise */
+#define BJNP_STATUS_TRIES 3	/* nr of times status query is sent */
+#define BJNP_ACK_TIMEOUT_USEC 30000000	/* default max. wait for an ack */
+#define BJNP_IDLE_POLL_USEC 100000	/* interval of idle checks after a job */
+#define BJNP_FINISH_WAIT 15	/* default max. wait (s) for printer to */
+				/* become idle after a job */
+#define BJNP_PROBE_MIN_USEC 200000	/* first wait for printer to come back */
+#define BJNP_PROBE_MAX_USEC 1000000	/* max. wait between probes */
+#define BJNP_RTO_INITIAL_USEC 1000000	/* wait for UDP response before */
+					/* round trip time is known */
+#define BJNP_RTO_MIN_USEC 200000	/* min. wait for UDP response */
+#define BJNP_RTO_MAX_USEC 4000000	/* max. wait for UDP response */
+#define BJNP_UDP_TRIES 3	/* nr of times a UDP command is sent */
+#define BJNP_CTL_MAX 4		/* max. nr of UDP requests waiting for */
+				/* a response */
+#define BJNP_SETUP_TRIES 3	/* nr of times job details are sent */
+#define BJNP_ATTEMPT_DELAY_USEC 250000	/* delay before next printer */
+					/* address is tried */
+#define BJNP_ATTEMPT_MAX 8	/* max. nr of printer addresses tried */
+#define BJNP_ID_CACHE_TTL 86400	/* max. age (s) of cached printer identity */
+#define BJNP_RESUME_MAX 3	/* max. nr of times a job is resumed */
+#define BJNP_REPLAY_DEFAULT 1048576	/* default nr of acked bytes kept to */
+					/* resume a job from stdin */
+#define BJNP_WINDOW_MAX 32	/* max. nr of print packets waiting for ack */
+#define BJNP_ZEROCOPY_MIN 16384	/* min. packet size to send with MSG_ZEROCOPY */
 #define BJNP_CMD_MAX 2048	/* size of BJNP response buffer */
 #define BJNP_RESP_MAX 2048	/* size of BJNP response buffer */
-#define BJNP_SOCK_MAX 256	/* maximum number of open sockets */
+#define BJNP_NAME_THREADS 8	/* max. nr of concurrent name lookups */
+#define BJNP_DISCOVER_IDLE_USEC 1000000	/* discovery ends this long after */
+					/* the last printer responded */
+#define BJNP_DISCOVER_CACHE_TTL 300	/* default max. age (s) of */
+					/* discovery cache */
+#define BJNP_DISCOVER_REFRESH_SEC 60	/* age (s) at which discovery */
+					/* cache is refreshed */
+#define BJNP_CACHE_LOCK_POLL_USEC 50000	/* interval to retry locking */
+					/* discovery cache */
+#define BJNP_DISCOVER_ROUNDS 3	/* default nr of discover broadcasts */
+#define BJNP_DISCOVER_ROUNDS_MAX 8	/* max. nr of discover broadcasts */
+#define BJNP_DISCOVER_SPACING_USEC 100000	/* time between first and */
+					/* second broadcast, doubles */
+					/* each round */
 #define BJNP_MODEL_MAX 64	/* max allowed size for make&model */
 #define BJNP_IEEE1284_MAX 1024	/* max. allowed size of IEEE1284 id */
 #define KEEP_ALIVE_SECONDS 3	/* max interval/2 seconds before we */
@@ -164,21 +207,87 @@ struct printer_list
   /* IEEE1284 printer id */
   int port;			/* udp/tcp port */
   char model[BJNP_MODEL_MAX];	/* printer make and model */
+  char mac_addr[6];		/* printers mac address */
+};
+
+/*
+ * header of the discovery cache file, followed by count printer_list
+ * entries
+ */
+
+#define BJNP_DISCOVER_CACHE_MAGIC "BJNPDC1"
+
+struct discover_cache
+{
+  char magic[8];		/* BJNP_DISCOVER_CACHE_MAGIC */
+  uint32_t entry_size;		/* sizeof (struct printer_list) */
+  uint32_t count;		/* nr of printers */
+  int64_t updated;		/* time of discovery */
 };
 
+/* called by bjnp_discover_printers() for each printer found */
 
+typedef void (*bjnp_found_t) (const struct printer_list * printer);
+
+
+
+/*
+ * state of the search for BJL commands in the print stream
+ */
+
+typedef struct bjnp_splitter_s
+{
+  ssize_t scanned;		/* stream offset of first byte not searched */
+  ssize_t next_cmd;		/* stream offset of next command, -1 if none */
+  int matched;			/* nr of command bytes matched at end of */
+				/* searched data */
+  ssize_t last_cmd;		/* stream offset of last command passed, */
+				/* -1 if none */
+} bjnp_splitter_t;
 
 /* 
  * bjnp printing related functions 
  */
 
-int bjnp_discover_printers (struct printer_list *list);
-http_addrlist_t *bjnp_send_job_details (http_addrlist_t * list, char *user,
-					char *title);
+int bjnp_discover_printers (struct printer_list **list, bjnp_found_t found,
+			    int expected, long deadline);
+http_addrlist_t *bjnp_start_job (http_addrlist_t * list, char *user,
+				  char *title, int *fd);
 void bjnp_finish_job (http_addrlist_t * list);
+http_addrlist_t *bjnp_resume_job (http_addrlist_t * list, int *fd);
 ssize_t bjnp_write (int fd, const void *buf, size_t count);
 int bjnp_backchannel (int fd, ssize_t * written);
+void bjnp_set_discover_rounds (int rounds);
+void bjnp_set_discover_interfaces (const char *include, const char *exclude);
+void bjnp_set_window (int size);
+int bjnp_get_window (void);
+int bjnp_acks_pending (void);
+int bjnp_write_ready (void);
+void bjnp_set_ack_timeout (int seconds);
+long bjnp_ack_wait (void);
+void bjnp_reset_window (int fd);
+int bjnp_enable_zerocopy (int fd);
+void bjnp_set_chunksize (int size);
+int bjnp_get_chunksize (void);
+int bjnp_get_chunksize_max (void);
+long bjnp_throttle_wait (void);
+void bjnp_split_reset (bjnp_splitter_t * sp, ssize_t pos);
+ssize_t bjnp_split_next (bjnp_splitter_t * sp, const char *ring,
+			 size_t ring_size, ssize_t send_pos, ssize_t read_pos,
+			 int eof);
+int bjnp_split_at_cmd (bjnp_splitter_t * sp, ssize_t send_pos);
+void bjnp_get_throttle_stats (int *count, long *msec);
+void bjnp_count_syscalls (int count);
+void bjnp_get_syscall_stats (unsigned long *syscalls, unsigned long *acked);
 bjnp_paper_status_t bjnp_get_paper_status (http_addrlist_t * addr);
+int bjnp_printer_idle (http_addrlist_t * addr);
+int bjnp_status_open (http_addrlist_t * addr);
+void bjnp_status_close (void);
+int bjnp_status_request (void);
+long bjnp_status_timeout (void);
+int bjnp_status_poll (bjnp_paper_status_t * paper);
+int bjnp_probe_printer (http_addrlist_t * addr, long usec);
+void bjnp_refresh_printer_id (void);
 
 /*
  * return values for bjnp_backchannel
@@ -229,6 +338,14 @@ extern int bjnp_backendGetMakeModel (const char *device_id, char *make_model,
 extern int bjnp_backendDrainOutput (int print_fd, int device_fd);
 extern ssize_t bjnp_backendRunLoop (int print_fd, int device_fd,
 				    http_addrlist_t * addr);
+extern ssize_t bjnp_backendRunLoopBuffer (const char *print_data,
+					  size_t print_size, int device_fd,
+					  http_addrlist_t * addr);
+extern void bjnp_backendSetReadahead (size_t size);
+extern int bjnp_backendSetEngine (const char *name);
+extern int bjnp_backendCancelled (void);
+extern void bjnp_backendSetReplay (size_t size);
+extern ssize_t bjnp_backendGetCheckpoint (void);
 
 /* definitions for functions available in cups 1.3 and later source tree only*/
 